@@ -56,6 +56,7 @@ extensions = [
     Extension("cysignals.pysignals", ["src/cysignals/pysignals.pyx"], **kwds),
     Extension("cysignals.alarm", ["src/cysignals/alarm.pyx"], **kwds),
     Extension("cysignals.pselect", ["src/cysignals/pselect.pyx"], **kwds),
+    Extension("cysignals.ffi", ["src/cysignals/ffi.pyx"], **kwds),
     Extension("cysignals.tests", ["src/cysignals/tests.pyx"], **kwds),
 ]
 
@@ -144,7 +145,8 @@ setup(
     packages=["cysignals"],
     package_dir={"cysignals": opj("src", "cysignals")},
     package_data={"cysignals": ["*.pxi", "*.pxd", "*.h"]},
-    data_files=[(opj("share", "cysignals"), [opj("src", "scripts", "cysignals-CSI-helper.py")])],
+    data_files=[(opj("share", "cysignals"), [opj("src", "scripts", "cysignals-CSI-helper.py")]),
+                (opj("share", "cysignals", "bpftrace"), glob(opj("src", "scripts", "bpftrace", "*.bt")))],
     scripts=glob(opj("src", "scripts", "cysignals-CSI")),
     cmdclass=dict(build=build, bdist_egg=no_egg),
 )
@@ -1,3 +1,4 @@
-from .signals import AlarmInterrupt, SignalError, init_cysignals  # noqa
+from .signals import AlarmInterrupt, CancelInterrupt, MappedFileError, SignalError, init_cysignals  # noqa
+from .ffi import call_interruptible  # noqa
 
 init_cysignals()
@@ -0,0 +1,166 @@
+/*
+Evaluation of many small items with one recovery point.
+
+sig_batch(f, n, arg, errors, status) calls f(i, arg) for i = 0, ..., n-1
+inside a single sig_on_local() scope, so the cost per item is just the
+function call. If an item dies from a critical signal (SIGSEGV, SIGFPE,
+SIGBUS, SIGILL or SIGABRT, in particular sig_error() after raising an
+exception), that item is marked as failed, a new scope is opened and
+the evaluation continues with the next item. Only the faulting item is
+lost, at the cost of one cysetjmp() per failure.
+
+The failed items are marked in the bitmap ``errors``, which must have
+room for n bits (see SIG_BATCH_BITMAP_SIZE): item i failed if bit
+i % 8 of errors[i / 8] is set. The exceptions raised for the failures
+are discarded, except the first one which is stored in ``status``
+together with the number of failures.
+
+Interrupts stop the whole batch, like in sig_on_local(): inside
+sig_on(), they jump back to the outermost sig_on(). Otherwise, the
+exception is raised and 0 is returned. On success, sig_batch() returns
+1, even if some items failed. In both cases, the caller must release
+status->first_exc.
+
+sig_batch_calls() does the same for an array of sig_kernel_t functions
+with their arguments.
+*/
+
+/*****************************************************************************
+ *  cysignals is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU Lesser General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  cysignals is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef CYSIGNALS_BATCH_H
+#define CYSIGNALS_BATCH_H
+
+#include <Python.h>
+#include <signal.h>
+#include <string.h>
+#include "struct_signals.h"
+#include "struct_dispatch.h"
+#include "struct_batch.h"
+#include "macros.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Number of bytes of the bitmap for a batch of n items */
+#define SIG_BATCH_BITMAP_SIZE(n) (((n) + 7) / 8)
+
+
+/* Did item i fail? */
+static inline int sig_batch_failed(const unsigned char* errors, size_t i)
+{
+    return (errors[i / 8] >> (i % 8)) & 1;
+}
+
+
+/* Is "sig" (the value returned by cysetjmp()) a failure of a single
+ * item, as opposed to an interrupt which stops the batch? */
+static inline int _sig_batch_item_fault(int sig)
+{
+    return sig == SIGSEGV || sig == SIGFPE || sig == SIGBUS ||
+           sig == SIGILL || sig == SIGABRT;
+}
+
+
+/* Mark item i as failed with signal "sig" and take the exception
+ * raised for it: keep the first one, discard the others */
+static inline void _sig_batch_fail(size_t i, int sig, unsigned char* errors,
+                                   sig_batch_status_t* status)
+{
+    errors[i / 8] |= (unsigned char)(1 << (i % 8));
+
+    PyGILState_STATE gilstate = PyGILState_Ensure();
+    PyObject *typ, *val, *tb;
+    PyErr_Fetch(&typ, &val, &tb);
+    if (status->nfailed == 0)
+    {
+        PyErr_NormalizeException(&typ, &val, &tb);
+        status->first_failed = i;
+        status->first_signal = sig;
+        status->first_exc = val;
+        val = NULL;
+    }
+    Py_XDECREF(typ);
+    Py_XDECREF(val);
+    Py_XDECREF(tb);
+    Py_CLEAR(cysigs.exc_value);
+    PyGILState_Release(gilstate);
+
+    status->nfailed++;
+}
+
+
+static inline int sig_batch(sig_batch_func f, size_t n, void* arg,
+                            unsigned char* errors, sig_batch_status_t* status)
+{
+    memset(errors, 0, SIG_BATCH_BITMAP_SIZE(n));
+    status->nfailed = 0;
+    status->first_failed = (size_t)-1;
+    status->first_signal = 0;
+    status->first_exc = NULL;
+
+    /* The item being evaluated, which must survive cylongjmp() */
+    volatile size_t i = 0;
+    while (i < n)
+    {
+        /* Like sig_on_local(), but keeping the signal number */
+        volatile int sig = 0;
+        if (!(unlikely(_sig_on_local_prejmp(0, NULL, __FILE__, __LINE__)) ||
+              _sig_on_local_postjmp(sig = cysetjmp(*_sig_on_local_env()))))
+        {
+            if (!_sig_batch_item_fault(sig)) return 0;
+            _sig_batch_fail(i, sig, errors, status);
+            i++;
+            continue;
+        }
+        for (; i < n; i++) f(i, arg);
+        sig_off_local();
+    }
+    return 1;
+}
+
+
+typedef struct
+{
+    const sig_kernel_t* funcs;
+    void* const* args;
+} _sig_batch_calls_t;
+
+static inline void _sig_batch_call(size_t i, void* arg)
+{
+    _sig_batch_calls_t* c = (_sig_batch_calls_t*)arg;
+    c->funcs[i](c->args ? c->args[i] : NULL);
+}
+
+/* Call funcs[i](args[i]) for i = 0, ..., n-1 like sig_batch(). If
+ * "args" is NULL, the functions are called with NULL. */
+static inline int sig_batch_calls(const sig_kernel_t* funcs, void* const* args, size_t n,
+                                  unsigned char* errors, sig_batch_status_t* status)
+{
+    _sig_batch_calls_t c;
+    c.funcs = funcs;
+    c.args = args;
+    return sig_batch(_sig_batch_call, n, &c, errors, status);
+}
+
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* ifndef CYSIGNALS_BATCH_H */
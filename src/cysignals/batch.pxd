@@ -0,0 +1,51 @@
+# cython: preliminary_late_includes_cy28=True
+"""
+Evaluation of many small items with one recovery point
+
+``sig_batch(f, n, arg, errors, &status)`` calls ``f(i, arg)`` for
+``i`` from 0 to ``n-1`` inside a single ``sig_on_local()`` scope. An
+item dying from a critical signal (or ``sig_error()``) is marked in the
+bitmap ``errors`` and the evaluation continues with the next item. The
+number of failures and the exception of the first one are stored in
+``status``; the caller must release ``status.first_exc``. Interrupts
+stop the whole batch. See ``batch.h`` for details.
+"""
+
+#*****************************************************************************
+#  cysignals is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Lesser General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  cysignals is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public License
+#  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+#
+#*****************************************************************************
+
+from cpython.object cimport PyObject
+from .signals cimport cysigs
+from .dispatch cimport sig_kernel_t
+
+
+cdef extern from "struct_batch.h":
+    ctypedef void (*sig_batch_func)(size_t i, void* arg) noexcept nogil
+
+    ctypedef struct sig_batch_status_t:
+        size_t nfailed
+        size_t first_failed
+        int first_signal
+        PyObject* first_exc
+
+
+cdef extern from "batch.h" nogil:
+    size_t SIG_BATCH_BITMAP_SIZE(size_t n)
+    bint sig_batch_failed(const unsigned char* errors, size_t i)
+    int sig_batch(sig_batch_func f, size_t n, void* arg,
+                  unsigned char* errors, sig_batch_status_t* status) except 0
+    int sig_batch_calls(const sig_kernel_t* funcs, void* const* args, size_t n,
+                        unsigned char* errors, sig_batch_status_t* status) except 0
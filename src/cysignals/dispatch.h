@@ -0,0 +1,137 @@
+/*
+Dispatch between variants of a kernel using different instruction sets.
+
+A kernel is compiled in several variants, ordered from the fastest
+(for example using AVX-512) to the most portable one. The first call of
+sig_dispatch() runs the first variant which has not failed before
+inside sig_on_local(). If it dies from SIGILL (an illegal instruction,
+typically because the CPU or an emulator does not support the
+instructions used), this is remembered in the sig_dispatch_t and the
+next variant is tried. The SignalError raised for this SIGILL is
+discarded. Once a variant completed successfully, later calls run it
+directly, without the overhead of sig_on_local().
+
+Other signals and interrupts are handled like in sig_on_local(): an
+exception is raised and the variant is not marked as failed. If every
+variant dies from SIGILL, the SignalError of the last one is raised and
+later calls raise RuntimeError.
+
+sig_dispatch() returns 1 on success and 0 if an exception was raised.
+Inside sig_on(), an interrupt jumps back to the outermost sig_on() as
+usual; other exceptions must be handled by the caller, for example
+with sig_error().
+*/
+
+/*****************************************************************************
+ *  cysignals is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU Lesser General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  cysignals is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef CYSIGNALS_DISPATCH_H
+#define CYSIGNALS_DISPATCH_H
+
+#include <Python.h>
+#include <signal.h>
+#include "struct_signals.h"
+#include "struct_dispatch.h"
+#include "macros.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+static inline void sig_dispatch_init(sig_dispatch_t* d, const char* name,
+                                     const sig_kernel_t* variants, int nvariants)
+{
+    d->name = name;
+    d->variants = variants;
+    d->nvariants = nvariants;
+    d->selected = 0;
+    d->verified = 0;
+}
+
+
+/* Discard the exception raised for the SIGILL of variant "v" and mark
+ * it as failed. Return 1 if there is another variant to try. If this
+ * was the last variant, keep the exception and return 0. */
+static inline int _sig_dispatch_failed(sig_dispatch_t* d, int v)
+{
+    if (d->selected == v) d->selected = v + 1;
+    if (v + 1 >= d->nvariants) return 0;
+
+    PyGILState_STATE gilstate = PyGILState_Ensure();
+    PyErr_Clear();
+    Py_CLEAR(cysigs.exc_value);
+    PyGILState_Release(gilstate);
+    return 1;
+}
+
+
+static inline int _sig_dispatch_none(sig_dispatch_t* d)
+{
+    PyGILState_STATE gilstate = PyGILState_Ensure();
+    PyErr_Format(PyExc_RuntimeError,
+            "no variant of kernel %s can be run on this CPU",
+            d->name ? d->name : "<unnamed>");
+    PyGILState_Release(gilstate);
+    return 0;
+}
+
+
+/* Run the selected variant of the kernel "d" with argument "arg" */
+static inline int sig_dispatch(sig_dispatch_t* d, void* arg)
+{
+    int v = d->selected;
+    if (likely(d->verified))
+    {
+        d->variants[v](arg);
+        return 1;
+    }
+
+    for (;;)
+    {
+        v = d->selected;
+        if (v >= d->nvariants) return _sig_dispatch_none(d);
+
+        /* Like sig_on_local(), but keeping the signal number */
+        volatile int sig = 0;
+        if (!(unlikely(_sig_on_local_prejmp(0, NULL, __FILE__, __LINE__)) ||
+              _sig_on_local_postjmp(sig = cysetjmp(*_sig_on_local_env()))))
+        {
+            if (sig == SIGILL && _sig_dispatch_failed(d, v)) continue;
+            return 0;
+        }
+        d->variants[v](arg);
+        sig_off_local();
+
+        d->verified = 1;
+        return 1;
+    }
+}
+
+
+/* Index of the variant which is used, or which will be tried first if
+ * none has been verified yet */
+static inline int sig_dispatch_selected(const sig_dispatch_t* d)
+{
+    return d->selected;
+}
+
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* ifndef CYSIGNALS_DISPATCH_H */
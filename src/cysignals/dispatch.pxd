@@ -0,0 +1,45 @@
+# cython: preliminary_late_includes_cy28=True
+"""
+Dispatch between kernel variants using different instruction sets
+
+The variants of a kernel are ordered from the fastest to the most
+portable one. The first call of ``sig_dispatch()`` runs them inside
+``sig_on_local()`` until one completes; a variant dying from ``SIGILL``
+is remembered as failed and skipped from then on. See ``dispatch.h``
+for details.
+"""
+
+#*****************************************************************************
+#  cysignals is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Lesser General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  cysignals is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public License
+#  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+#
+#*****************************************************************************
+
+from .signals cimport cysigs
+
+
+cdef extern from "struct_dispatch.h":
+    ctypedef void (*sig_kernel_t)(void* arg) noexcept nogil
+
+    ctypedef struct sig_dispatch_t:
+        const char* name
+        int nvariants
+        int selected
+        int verified
+
+
+cdef extern from "dispatch.h" nogil:
+    void sig_dispatch_init(sig_dispatch_t* d, const char* name,
+                           const sig_kernel_t* variants, int nvariants)
+    int sig_dispatch(sig_dispatch_t* d, void* arg) except 0
+    int sig_dispatch_selected(const sig_dispatch_t* d)
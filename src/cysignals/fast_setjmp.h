@@ -0,0 +1,124 @@
+/*
+ * Minimal setjmp()/longjmp() for sig_on()
+ *
+ * cyfast_setjmp() saves only the callee-saved registers, the stack
+ * pointer and the return address. Unlike the C library versions, it
+ * does not save the signal mask (like sigsetjmp(env, 0)), does not
+ * mangle pointers and does not maintain a shadow stack. It must not be
+ * used in processes running with hardware shadow stacks (Intel CET
+ * SHSTK) enabled.
+ *
+ * This is enabled with ./configure --enable-fast-setjmp. It is only
+ * available on x86-64 (System V ABI) and aarch64 with ELF.
+ */
+
+#ifndef CYSIGNALS_FAST_SETJMP_H
+#define CYSIGNALS_FAST_SETJMP_H
+
+#if defined(__ELF__) && defined(__x86_64__) && !defined(__ILP32__)
+#define CYFAST_SETJMP_SUPPORTED 1
+/* rbx, rbp, r12-r15, rsp, rip */
+typedef long cyfast_jmp_buf[8];
+
+/* The functions are local symbols, defined in every object file
+ * which includes this header. The section is saved and restored since
+ * the compiler does not expect top-level asm to change it. */
+__asm__(
+    ".pushsection .text\n"
+    ".p2align 4\n"
+    ".type cyfast_setjmp, @function\n"
+    "cyfast_setjmp:\n"
+    "    movq %rbx, 0(%rdi)\n"
+    "    movq %rbp, 8(%rdi)\n"
+    "    movq %r12, 16(%rdi)\n"
+    "    movq %r13, 24(%rdi)\n"
+    "    movq %r14, 32(%rdi)\n"
+    "    movq %r15, 40(%rdi)\n"
+    "    leaq 8(%rsp), %rdx\n"      /* stack pointer after returning */
+    "    movq %rdx, 48(%rdi)\n"
+    "    movq (%rsp), %rdx\n"       /* return address */
+    "    movq %rdx, 56(%rdi)\n"
+    "    xorl %eax, %eax\n"
+    "    ret\n"
+    ".size cyfast_setjmp, .-cyfast_setjmp\n"
+    "\n"
+    ".p2align 4\n"
+    ".type cyfast_longjmp, @function\n"
+    "cyfast_longjmp:\n"
+    "    movl %esi, %eax\n"
+    "    testl %eax, %eax\n"
+    "    jnz 1f\n"
+    "    incl %eax\n"
+    "1:  movq 0(%rdi), %rbx\n"
+    "    movq 8(%rdi), %rbp\n"
+    "    movq 16(%rdi), %r12\n"
+    "    movq 24(%rdi), %r13\n"
+    "    movq 32(%rdi), %r14\n"
+    "    movq 40(%rdi), %r15\n"
+    "    movq 48(%rdi), %rsp\n"
+    "    jmpq *56(%rdi)\n"
+    ".size cyfast_longjmp, .-cyfast_longjmp\n"
+    ".popsection\n"
+);
+
+#elif defined(__ELF__) && defined(__aarch64__) && !defined(__ILP32__)
+#define CYFAST_SETJMP_SUPPORTED 1
+/* x19-x30, sp, d8-d15 */
+typedef long cyfast_jmp_buf[21];
+
+__asm__(
+    ".pushsection .text\n"
+    ".p2align 2\n"
+    ".type cyfast_setjmp, %function\n"
+    "cyfast_setjmp:\n"
+    "    stp x19, x20, [x0, #0]\n"
+    "    stp x21, x22, [x0, #16]\n"
+    "    stp x23, x24, [x0, #32]\n"
+    "    stp x25, x26, [x0, #48]\n"
+    "    stp x27, x28, [x0, #64]\n"
+    "    stp x29, x30, [x0, #80]\n"   /* x30 is the return address */
+    "    mov x2, sp\n"
+    "    str x2, [x0, #96]\n"
+    "    stp d8, d9, [x0, #104]\n"
+    "    stp d10, d11, [x0, #120]\n"
+    "    stp d12, d13, [x0, #136]\n"
+    "    stp d14, d15, [x0, #152]\n"
+    "    mov w0, #0\n"
+    "    ret\n"
+    ".size cyfast_setjmp, .-cyfast_setjmp\n"
+    "\n"
+    ".p2align 2\n"
+    ".type cyfast_longjmp, %function\n"
+    "cyfast_longjmp:\n"
+    "    ldp x19, x20, [x0, #0]\n"
+    "    ldp x21, x22, [x0, #16]\n"
+    "    ldp x23, x24, [x0, #32]\n"
+    "    ldp x25, x26, [x0, #48]\n"
+    "    ldp x27, x28, [x0, #64]\n"
+    "    ldp x29, x30, [x0, #80]\n"
+    "    ldr x2, [x0, #96]\n"
+    "    mov sp, x2\n"
+    "    ldp d8, d9, [x0, #104]\n"
+    "    ldp d10, d11, [x0, #120]\n"
+    "    ldp d12, d13, [x0, #136]\n"
+    "    ldp d14, d15, [x0, #152]\n"
+    "    cmp w1, #0\n"
+    "    csinc w0, w1, wzr, ne\n"
+    "    ret\n"
+    ".size cyfast_longjmp, .-cyfast_longjmp\n"
+    ".popsection\n"
+);
+#endif
+
+#if CYFAST_SETJMP_SUPPORTED
+#ifdef __cplusplus
+extern "C" {
+#endif
+int cyfast_setjmp(cyfast_jmp_buf env) __attribute__((returns_twice, nothrow));
+void cyfast_longjmp(cyfast_jmp_buf env, int val) __attribute__((noreturn, nothrow));
+#ifdef __cplusplus
+}
+#endif
+#endif
+
+#endif  /* ifndef CYSIGNALS_FAST_SETJMP_H */
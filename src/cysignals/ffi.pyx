@@ -0,0 +1,305 @@
+"""
+Interruptible calls of foreign functions
+
+This module calls C functions obtained through ``ctypes`` or ``cffi``
+inside ``sig_on()``, such that interrupts and critical signals raise
+the usual exceptions also when the C code was not written with
+``cysignals`` in mind.
+"""
+
+#*****************************************************************************
+#  cysignals is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Lesser General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  cysignals is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public License
+#  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+#
+#*****************************************************************************
+
+from __future__ import absolute_import
+
+from libc.stdint cimport intptr_t, uintptr_t
+
+from .signals cimport sig_on, sig_off
+
+
+cdef enum:
+    MAX_ARGS = 8  # Maximum number of arguments of a foreign function
+
+ctypedef intptr_t (*int_func)(intptr_t, intptr_t, intptr_t, intptr_t,
+                              intptr_t, intptr_t, intptr_t, intptr_t) nogil
+ctypedef double (*double_func)(double, double, double, double,
+                               double, double, double, double) nogil
+
+# Kinds of arguments and return values
+cdef enum:
+    KIND_INT      # Integer or pointer, passed in an intptr_t
+    KIND_DOUBLE
+    KIND_VOID
+
+
+cdef intptr_t call_int(void* f, intptr_t* a) noexcept nogil:
+    # Passing more arguments than the function takes is harmless with
+    # the calling conventions of the supported platforms, where they
+    # are passed in registers or cleaned up by the caller.
+    return (<int_func>f)(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7])
+
+
+cdef double call_double(void* f, double* a) noexcept nogil:
+    return (<double_func>f)(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7])
+
+
+cdef int arg_kind_ctypes(t) except -1:
+    import ctypes
+    if t is ctypes.c_double:
+        return KIND_DOUBLE
+    if t in (ctypes.c_float, ctypes.c_longdouble):
+        raise TypeError("arguments of type %s are not supported" % t.__name__)
+    if isinstance(t, type) and issubclass(t, ctypes.Structure):
+        raise TypeError("structures cannot be passed by value")
+    return KIND_INT
+
+
+cdef int ret_kind_ctypes(t) except -1:
+    import ctypes
+    if t is None:
+        return KIND_VOID
+    if t is ctypes.c_double:
+        return KIND_DOUBLE
+    if t in (ctypes.c_float, ctypes.c_longdouble):
+        raise TypeError("return type %s is not supported" % t.__name__)
+    if isinstance(t, type) and issubclass(t, ctypes.Structure):
+        raise TypeError("structures cannot be returned by value")
+    return KIND_INT
+
+
+cdef int kind_cffi(t, what) except -1:
+    if t.kind == "void":
+        return KIND_VOID
+    if t.kind == "primitive" and t.cname == "double":
+        return KIND_DOUBLE
+    if t.kind == "primitive" and t.cname in ("float", "long double"):
+        raise TypeError("%s of type %s is not supported" % (what, t.cname))
+    if t.kind in ("primitive", "pointer", "enum"):
+        return KIND_INT
+    raise TypeError("%s of type %s is not supported" % (what, t.cname))
+
+
+cdef intptr_t int_arg(x) except? -1:
+    """
+    Convert ``x`` to an integer or pointer argument
+    """
+    if x is None:
+        return 0
+    if isinstance(x, bytes):
+        return <intptr_t><char*>x
+    if isinstance(x, int):
+        if x < 0:
+            return <intptr_t>x
+        return <intptr_t><uintptr_t>x
+
+    cls = type(x)
+    if cls.__module__ == "_cffi_backend":
+        import _cffi_backend as backend
+        return int(backend.cast(backend.new_primitive_type("intptr_t"), x))
+
+    import ctypes
+    if hasattr(x, "_as_parameter_"):
+        return int_arg(x._as_parameter_)
+    if isinstance(x, (ctypes.Array, ctypes.Structure, ctypes.Union)):
+        # Arrays decay to pointers, structures are passed by reference
+        return ctypes.addressof(x)
+    if isinstance(x, ctypes._Pointer):
+        return int_arg(ctypes.cast(x, ctypes.c_void_p).value)
+    if isinstance(x, ctypes._SimpleCData):
+        return int_arg(x.value)
+    return int(x)
+
+
+def call_interruptible(cfunc, *args, release_gil=True):
+    """
+    Call the C function ``cfunc`` with arguments ``args`` inside
+    ``sig_on()``.
+
+    An interrupt (for example ``CTRL-C`` or an :func:`alarm`) stops the
+    call and raises ``KeyboardInterrupt`` (or ``AlarmInterrupt``). A
+    critical signal like ``SIGSEGV`` raises ``SignalError`` instead of
+    killing the interpreter. The state of the C library may be
+    inconsistent after this, like for any other interrupted computation.
+
+    INPUT:
+
+    - ``cfunc`` -- a ``ctypes`` function, a ``cffi`` function or the
+      address of a C function as integer
+
+    - ``args`` -- at most 8 arguments which are either all integers or
+      pointers (given as ``int``, ``bytes``, ``None``, ``ctypes`` or
+      ``cffi`` objects) or all ``double``
+
+    - ``release_gil`` -- (default: ``True``) release the GIL during the
+      call, allowing other Python threads to run
+
+    The argument and return types are taken from the ``argtypes`` and
+    ``restype`` of a ``ctypes`` function or from the type of a ``cffi``
+    function. For an address or a ``ctypes`` function without
+    ``argtypes``, Python ``float`` arguments are passed as ``double``;
+    for an address, the result is returned as an ``int`` of the size of
+    a pointer. ``float``, ``long double`` and structures by value are
+    not supported.
+
+    EXAMPLES::
+
+        >>> import ctypes, ctypes.util
+        >>> from cysignals import call_interruptible
+        >>> libc = ctypes.CDLL(ctypes.util.find_library("c"))
+        >>> call_interruptible(libc.strlen, b"cysignals")
+        9
+        >>> libm = ctypes.CDLL(ctypes.util.find_library("m"))
+        >>> libm.pow.restype = ctypes.c_double
+        >>> libm.pow.argtypes = [ctypes.c_double, ctypes.c_double]
+        >>> call_interruptible(libm.pow, 2, 10)
+        1024.0
+        >>> addr = ctypes.cast(libc.labs, ctypes.c_void_p).value
+        >>> call_interruptible(addr, -42)
+        42
+
+    Interrupts and crashes raise exceptions::
+
+        >>> from cysignals.alarm import alarm
+        >>> try:
+        ...     alarm(0.5)
+        ...     call_interruptible(libc.sleep, 5)
+        ... except KeyboardInterrupt as e:
+        ...     print(type(e).__name__)
+        AlarmInterrupt
+        >>> call_interruptible(libc.strlen, None)
+        Traceback (most recent call last):
+        ...
+        SignalError: Segmentation fault
+
+    TESTS::
+
+        >>> call_interruptible(libm.pow, 2, *range(8))
+        Traceback (most recent call last):
+        ...
+        TypeError: at most 8 arguments are supported
+        >>> libm.ldexp.restype = ctypes.c_double
+        >>> libm.ldexp.argtypes = [ctypes.c_double, ctypes.c_int]
+        >>> call_interruptible(libm.ldexp, 1.5, 3)
+        Traceback (most recent call last):
+        ...
+        TypeError: mixed integer and floating-point arguments are not supported
+        >>> call_interruptible(libc.strlen, b"abc", release_gil=False)
+        3
+        >>> libm.fmax.restype = ctypes.c_double
+        >>> call_interruptible(libm.fmax, 1.5, 2.5)
+        2.5
+
+    """
+    cdef Py_ssize_t n = len(args)
+    if n > MAX_ARGS:
+        raise TypeError("at most %s arguments are supported" % MAX_ARGS)
+
+    import ctypes
+    argtypes = None
+    restype = None
+    ctype = None
+    cdef int ret_kind = KIND_INT
+    cdef void* f
+
+    if isinstance(cfunc, int):
+        f = <void*><uintptr_t>cfunc
+        kinds = [KIND_DOUBLE if isinstance(x, float) else KIND_INT for x in args]
+    elif type(cfunc).__module__ == "_cffi_backend":
+        import _cffi_backend as backend
+        ctype = backend.typeof(cfunc)
+        if ctype.kind != "function":
+            raise TypeError("cffi object is not a function")
+        if ctype.ellipsis:
+            raise TypeError("variadic functions are not supported")
+        if len(ctype.args) != n:
+            raise TypeError("function takes %s arguments (%s given)" % (len(ctype.args), n))
+        f = <void*><uintptr_t>int_arg(cfunc)
+        kinds = [kind_cffi(t, "argument") for t in ctype.args]
+        ret_kind = kind_cffi(ctype.result, "return value")
+    elif isinstance(cfunc, ctypes._CFuncPtr):
+        f = <void*><uintptr_t>ctypes.cast(cfunc, ctypes.c_void_p).value
+        argtypes = cfunc.argtypes
+        restype = cfunc.restype
+        if argtypes is not None:
+            if len(argtypes) != n:
+                raise TypeError("function takes %s arguments (%s given)" % (len(argtypes), n))
+            kinds = [arg_kind_ctypes(t) for t in argtypes]
+        else:
+            kinds = [KIND_DOUBLE if isinstance(x, (float, ctypes.c_double)) else KIND_INT for x in args]
+        ret_kind = ret_kind_ctypes(restype)
+    else:
+        raise TypeError("cannot call %r" % (cfunc,))
+
+    if f is NULL:
+        raise ValueError("NULL function pointer")
+
+    # Only functions taking and returning either integers or doubles
+    # can be called; a void return value fits both
+    if ret_kind != KIND_VOID:
+        kinds.append(ret_kind)
+    cdef bint use_double = KIND_DOUBLE in kinds
+    if use_double and KIND_INT in kinds:
+        raise TypeError("mixed integer and floating-point arguments are not supported")
+
+    cdef intptr_t iargs[MAX_ARGS]
+    cdef double dargs[MAX_ARGS]
+    cdef intptr_t iret = 0
+    cdef double dret = 0
+    cdef Py_ssize_t i
+    for i in range(MAX_ARGS):
+        iargs[i] = 0
+        dargs[i] = 0
+    for i in range(n):
+        x = args[i]
+        if use_double:
+            dargs[i] = x.value if isinstance(x, ctypes.c_double) else x
+        else:
+            iargs[i] = int_arg(x)
+
+    if release_gil:
+        with nogil:
+            sig_on()
+            if use_double:
+                dret = call_double(f, dargs)
+            else:
+                iret = call_int(f, iargs)
+            sig_off()
+    else:
+        sig_on()
+        if use_double:
+            dret = call_double(f, dargs)
+        else:
+            iret = call_int(f, iargs)
+        sig_off()
+
+    # The bytes objects in args were kept alive until here
+    if ret_kind == KIND_VOID:
+        return None
+    if ret_kind == KIND_DOUBLE:
+        return dret
+    if ctype is not None:
+        import _cffi_backend as backend
+        r = backend.cast(ctype.result, iret)
+        return r if ctype.result.kind == "pointer" else int(r)
+    if restype is None:
+        return iret
+    if restype is ctypes.c_bool:
+        return bool(iret & 0xff)
+    if isinstance(restype, type) and issubclass(restype, ctypes._Pointer):
+        return ctypes.cast(ctypes.c_void_p(iret), restype)
+    if isinstance(restype, type) and issubclass(restype, ctypes._SimpleCData):
+        return restype(iret).value
+    return restype(iret)
@@ -33,17 +33,36 @@ Interrupt and signal handling for Cython
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <time.h>
 #include <errno.h>
 #include <pthread.h>
 #if HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 #if HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
 #if HAVE_SYS_WAIT_H
 #include <sys/wait.h>
 #endif
+#if HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#if HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+#if HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#endif
+#if HAVE_LINUX_MEMPOLICY_H
+#include <linux/mempolicy.h>
+#endif
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -56,123 +75,1601 @@ Interrupt and signal handling for Cython
 #if HAVE_WINDOWS_H
 #include <windows.h>
 #endif
+#if defined(SYS_futex) && defined(FUTEX_WAIT_PRIVATE)
+#define HAVE_FUTEX 1
+#endif
 #include <Python.h>
 #if HAVE_PARI
 #include <pari/pari.h>
 #else
-/* Fake PARI variables */
-static int PARI_SIGINT_block = 0;
-static int PARI_SIGINT_pending = 0;
 #define paricfg_version NULL
 #endif
 #include "struct_signals.h"
+#include "probes.h"
 
 
 #if ENABLE_DEBUG_CYSIGNALS
 static struct timeval sigtime;  /* Time of signal */
 #endif
 
-/* The cysigs object (there is a unique copy of this, shared by all
- * Cython modules using cysignals) */
-static cysigs_t cysigs;
+/* The cysigs object (there is a unique copy of this, shared by all
+ * Cython modules using cysignals). This is process-wide state, like
+ * the signal handlers themselves: Cython modules can only be loaded
+ * into one interpreter per process, so there is no per-interpreter
+ * copy. */
+static cysigs_t cysigs;
+
+#if HAVE_SIGPROCMASK
+/* The default signal mask during normal operation,
+ * initialized by setup_cysignals_handlers(). */
+static sigset_t default_sigmask;
+
+/* default_sigmask with SIGHUP, SIGINT, SIGALRM added. */
+static sigset_t sigmask_with_sigint;
+#endif
+
+/* A trampoline to jump to after handling a signal. */
+static cyjmp_buf trampoline_setup;
+static sigjmp_buf trampoline;
+
+/* Where the trampoline jumps to: cysigs.env or the jump buffer of a
+ * sig_on_local() scope */
+static cyjmp_buf* volatile trampoline_target = &cysigs.env;
+
+static void setup_cysignals_handlers(void);
+static void cysigs_interrupt_handler(int sig, siginfo_t* info, void* context);
+static void cysigs_signal_handler(int sig, siginfo_t* info, void* context);
+
+static void do_raise_exception(int sig);
+static void sigdie(int sig, const char* s);
+
+#define BACKTRACELEN 1024
+static void print_backtrace(void);
+
+/* Implemented in signals.pyx */
+static int sig_raise_exception(int sig, const char* msg);
+static void sig_run_yield_callbacks(void);
+
+
+/* Do whatever is needed to reset the CPU to a sane state after
+ * handling a signals.  In particular on x86 CPUs, we need to clear
+ * the FPU (this is needed after MMX instructions have been used or
+ * if an interrupt occurs during an FPU computation).
+ * Linux and OS X 10.6 do this as part of their signals implementation,
+ * but Solaris doesn't.  Since this code is called only when handling a
+ * signal (which should be very rare), it's better to play safe and
+ * always execute this instead of special-casing based on the operating
+ * system.
+ * See http://trac.sagemath.org/sage_trac/ticket/12873
+ */
+static inline void reset_CPU(void)
+{
+#if HAVE_EMMS
+    /* Clear FPU tag word */
+    asm("emms");
+#endif
+}
+
+
+/* Reset all signal handlers and the signal mask to their defaults. */
+static inline void sig_reset_defaults(void) {
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGILL, SIG_DFL);
+    signal(SIGABRT, SIG_DFL);
+    signal(SIGFPE, SIG_DFL);
+    signal(SIGBUS, SIG_DFL);
+    signal(SIGSEGV, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+#if HAVE_SIGPROCMASK
+    sigprocmask(SIG_SETMASK, &default_sigmask, NULL);
+#endif
+}
+
+
+/* Call sigdie() with the appropriate error message for the signal, or
+ * whether the exception occurred inside our signal handler */
+static inline void sigdie_for_sig(int sig, int inside)
+{
+    sig_reset_defaults();
+
+    /* Quit Python with an appropriate message.
+       Make sure to check the standard signals from the C standard first,
+       in case systems alias some of these constants. */
+    if (inside)
+        sigdie(sig, "An error occurred during signal handling.");
+    else if (sig == SIGILL)
+        sigdie(sig, "Unhandled SIGILL: An illegal instruction occurred.");
+    else if (sig == SIGABRT)
+        sigdie(sig, "Unhandled SIGABRT: An abort() occurred.");
+    else if (sig == SIGFPE)
+        sigdie(sig, "Unhandled SIGFPE: An unhandled floating point exception occurred.");
+    else if (sig == SIGSEGV)
+        sigdie(sig, "Unhandled SIGSEGV: A segmentation fault occurred.");
+    else if (sig == SIGBUS)
+        sigdie(sig, "Unhandled SIGBUS: A bus error occurred.");
+    else if (sig == SIGQUIT)
+        sigdie(sig, NULL);
+    else
+        sigdie(sig, "Unknown signal received.");
+}
+
+
+/* Memory regions with special handling of SIGSEGV/SIGBUS. These are
+ * registered in a table such that the signal handler can find the
+ * region from the faulting address.
+ *
+ * - Guarded arrays: buffers mapped between two inaccessible guard
+ *   pages, see sig_guarded_malloc() in memory.pxd. An access to the
+ *   guard pages raises an exception naming the overflowed buffer.
+ *
+ * - Lazy arrays: buffers which are initially inaccessible, see
+ *   sig_lazy_malloc() in memory.pxd. On the first access to a page,
+ *   the signal handler calls a fill function computing the contents
+ *   of that page, makes the page readable and resumes execution.
+ *
+ * - Mapped files: files mapped with sig_mmap_file() in memory.pxd. A
+ *   SIGBUS on such a region (the file was truncated or could not be
+ *   read) raises MappedFileError naming the file and the offset. */
+#define MAX_REGIONS 256
+#define REGION_NAME_LEN 256
+
+#define REGION_GUARDED 1
+#define REGION_LAZY    2
+#define REGION_FILE    3
+
+#if HAVE_MMAP && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+typedef struct
+{
+    /* Start of the whole mapping (including guard pages) or NULL if
+     * this slot is unused. This is set last when registering and
+     * cleared first when unregistering, such that the signal handler
+     * never sees a partially initialized entry. */
+    char* volatile map;
+    size_t maplen;
+    int kind;
+
+    /* The memory which was handed out to the user */
+    char* data;
+    size_t size;
+
+    /* For lazy arrays: the fill function with its argument and a
+     * bitmap of pages which have been filled already. For mapped
+     * files: a bitmap of pages which could not be read. */
+    sig_lazy_fill_func fill;
+    void* fill_arg;
+    volatile unsigned char* filled;
+
+    /* For mapped files: offset in the file of the byte at ``data`` */
+    long long file_offset;
+
+    char name[REGION_NAME_LEN];
+} cysigs_region_t;
+
+static cysigs_region_t regions[MAX_REGIONS];
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Exception message for an invalid access to a region */
+static char region_fault_msg[REGION_NAME_LEN + 128];
+
+/* File name and offset of the last failed access to a mapped file,
+ * used by sig_raise_exception() for SIG_MAPPED_FILE */
+static char mapped_fault_name[REGION_NAME_LEN];
+static long long mapped_fault_offset;
+
+
+static size_t page_size(void)
+{
+    static size_t ps = 0;
+    if (!ps)
+    {
+#if HAVE_UNISTD_H && defined(_SC_PAGESIZE)
+        ps = sysconf(_SC_PAGESIZE);
+#else
+        ps = 4096;
+#endif
+    }
+    return ps;
+}
+
+
+#if HAVE_MMAP
+/* Store a new region in the table. Return the region or NULL if the
+ * table is full. */
+static cysigs_region_t* add_region(int kind, char* map, size_t maplen,
+        char* data, size_t size, const char* name,
+        sig_lazy_fill_func fill, void* fill_arg, unsigned char* filled)
+{
+    pthread_mutex_lock(&regions_lock);
+    int i;
+    for (i = 0; i < MAX_REGIONS; i++)
+    {
+        cysigs_region_t* r = &regions[i];
+        if (r->map) continue;
+
+        r->kind = kind;
+        r->maplen = maplen;
+        r->data = data;
+        r->size = size;
+        r->fill = fill;
+        r->fill_arg = fill_arg;
+        r->filled = filled;
+        r->file_offset = 0;
+        snprintf(r->name, sizeof(r->name), "%s", name ? name : "");
+        r->map = map;
+        pthread_mutex_unlock(&regions_lock);
+        return r;
+    }
+    pthread_mutex_unlock(&regions_lock);
+    return NULL;
+}
+#endif
+
+
+/* Remove the region of the given kind whose data starts at ``ptr``
+ * and unmap it. Return 0 on success, -1 if there is no such region. */
+static int free_region(int kind, void* ptr)
+{
+#if HAVE_MMAP
+    pthread_mutex_lock(&regions_lock);
+    int i;
+    for (i = 0; i < MAX_REGIONS; i++)
+    {
+        cysigs_region_t* r = &regions[i];
+        if (r->map && r->kind == kind && r->data == ptr)
+        {
+            /* The slot may be reused as soon as the lock is released */
+            char* map = r->map;
+            size_t maplen = r->maplen;
+            void* filled = (void*)r->filled;
+            r->map = NULL;
+            pthread_mutex_unlock(&regions_lock);
+            munmap(map, maplen);
+            free(filled);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&regions_lock);
+#endif
+    return -1;
+}
+
+
+/* Return the region containing ``addr`` or NULL if there is none.
+ * This is called from the signal handler, so it cannot take locks. */
+static cysigs_region_t* find_region(const char* addr)
+{
+    int i;
+    for (i = 0; i < MAX_REGIONS; i++)
+    {
+        cysigs_region_t* r = &regions[i];
+        const char* map = r->map;
+        if (map && map <= addr && addr < map + r->maplen)
+            return r;
+    }
+    return NULL;
+}
+
+
+/* Allocate ``n`` bytes such that the first byte after the buffer is
+ * on an inaccessible guard page. There is a second guard page before
+ * the buffer, but since the buffer is aligned to the end of its
+ * pages, only accesses before the start of those pages are caught.
+ * The name is used in the exception message for a guard page
+ * violation. Return NULL on failure.
+ *
+ * This must be called with interrupts blocked, see sig_block(). */
+static void* _sig_guarded_malloc(size_t n, const char* name)
+{
+#if HAVE_MMAP
+    size_t ps = page_size();
+    if (n > SIZE_MAX - 3*ps) return NULL;
+    size_t datalen = (n + ps - 1) & ~(ps - 1);
+    size_t maplen = datalen + 2*ps;
+
+    char* map = mmap(NULL, maplen, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+    if (datalen && mprotect(map + ps, datalen, PROT_READ|PROT_WRITE))
+    {
+        munmap(map, maplen);
+        return NULL;
+    }
+
+    char* data = map + ps + datalen - n;
+    if (!add_region(REGION_GUARDED, map, maplen, data, n, name, NULL, NULL, NULL))
+    {
+        munmap(map, maplen);
+        return NULL;
+    }
+    return data;
+#else
+    /* No guard pages are possible, fall back to malloc() */
+    return malloc(n);
+#endif
+}
+
+
+/* Free memory allocated by _sig_guarded_malloc().
+ *
+ * This must be called with interrupts blocked, see sig_block(). */
+static void _sig_guarded_free(void* ptr)
+{
+    if (ptr == NULL) return;
+#if HAVE_MMAP
+    if (free_region(REGION_GUARDED, ptr))
+    {
+        fprintf(stderr, "sig_guarded_free() called with a pointer %p which was not allocated by sig_guarded_malloc()\n", ptr);
+        print_backtrace();
+    }
+#else
+    free(ptr);
+#endif
+}
+
+
+/* Reserve ``n`` bytes of inaccessible memory. The contents of each
+ * page are computed on first access by calling
+ * ``fill(page, offset, len, arg)`` from the signal handler, where
+ * ``page`` is a temporary buffer which must be filled with ``len``
+ * bytes corresponding to the bytes starting at ``offset`` of the
+ * array. Afterwards, the page is read-only. Return NULL on failure.
+ *
+ * This must be called with interrupts blocked, see sig_block(). */
+static void* _sig_lazy_malloc(size_t n, sig_lazy_fill_func fill, void* arg, const char* name)
+{
+#if HAVE_MMAP
+    size_t ps = page_size();
+    if (n == 0 || n > SIZE_MAX - ps) return NULL;
+    size_t maplen = (n + ps - 1) & ~(ps - 1);
+    size_t npages = maplen / ps;
+
+    unsigned char* filled = calloc((npages + 7) / 8, 1);
+    if (!filled) return NULL;
+
+    char* map = mmap(NULL, maplen, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        free(filled);
+        return NULL;
+    }
+
+    if (!add_region(REGION_LAZY, map, maplen, map, n, name, fill, arg, filled))
+    {
+        munmap(map, maplen);
+        free(filled);
+        return NULL;
+    }
+    return map;
+#else
+    return NULL;
+#endif
+}
+
+
+/* Free memory allocated by _sig_lazy_malloc().
+ *
+ * This must be called with interrupts blocked, see sig_block(). */
+static void _sig_lazy_free(void* ptr)
+{
+    if (ptr == NULL) return;
+    if (free_region(REGION_LAZY, ptr))
+    {
+        fprintf(stderr, "sig_lazy_free() called with a pointer %p which was not allocated by sig_lazy_malloc()\n", ptr);
+        print_backtrace();
+    }
+}
+
+
+/* Map ``length`` bytes of the file ``fd`` starting at ``offset``
+ * (which need not be aligned to pages), or the rest of the file if
+ * ``length`` is 0. The mapping is shared and it is writable if
+ * ``writable`` is nonzero. The ``name`` (typically the file name) is
+ * used in the exception raised when the file cannot be read. Return
+ * NULL with errno set on failure.
+ *
+ * This must be called with interrupts blocked, see sig_block(). */
+static void* _sig_mmap_file(int fd, long long offset, size_t length, int writable, const char* name)
+{
+#if HAVE_MMAP
+    if (offset < 0) {errno = EINVAL; return NULL;}
+    if (length == 0)
+    {
+        struct stat st;
+        if (fstat(fd, &st)) return NULL;
+        if (st.st_size <= offset) {errno = EINVAL; return NULL;}
+        length = (size_t)(st.st_size - offset);
+    }
+
+    size_t ps = page_size();
+    size_t skip = (size_t)(offset % (long long)ps);
+    if (length > SIZE_MAX - ps - skip) {errno = ENOMEM; return NULL;}
+    size_t maplen = (skip + length + ps - 1) & ~(ps - 1);
+    size_t npages = maplen / ps;
+
+    unsigned char* bad = calloc((npages + 7) / 8, 1);
+    if (!bad) return NULL;
+
+    int prot = writable ? PROT_READ|PROT_WRITE : PROT_READ;
+    char* map = mmap(NULL, maplen, prot, MAP_SHARED, fd, (off_t)(offset - (long long)skip));
+    if (map == MAP_FAILED)
+    {
+        free(bad);
+        return NULL;
+    }
+
+    cysigs_region_t* r = add_region(REGION_FILE, map, maplen, map + skip, length, name, NULL, NULL, bad);
+    if (!r)
+    {
+        munmap(map, maplen);
+        free(bad);
+        errno = ENOMEM;
+        return NULL;
+    }
+    r->file_offset = offset;
+    return map + skip;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+
+/* Unmap a file mapped by _sig_mmap_file(). Return 0 on success, -1 if
+ * ``ptr`` was not returned by _sig_mmap_file().
+ *
+ * This must be called with interrupts blocked, see sig_block(). */
+static int _sig_munmap_file(void* ptr)
+{
+    if (ptr == NULL) return 0;
+    return free_region(REGION_FILE, ptr);
+}
+
+
+/* Handle a fault at ``addr`` if it is a failed read of a mapped file:
+ * a SIGBUS, or a later access to a page which failed before. Store the
+ * file name and offset for sig_raise_exception() and return 1.
+ * Otherwise, return 0.
+ *
+ * The failing page is replaced by an inaccessible anonymous page, so
+ * every later access to it fails in the same way, even if the file
+ * grows again. The address range stays reserved until the file is
+ * unmapped. */
+static int file_fault(int sig, const char* addr)
+{
+#if HAVE_MMAP
+    cysigs_region_t* r = find_region(addr);
+    if (!r || r->kind != REGION_FILE) return 0;
+
+    size_t ps = page_size();
+    size_t pageno = (size_t)(addr - r->map) / ps;
+    unsigned char bit = 1 << (pageno % 8);
+
+    if (sig == SIGBUS)
+    {
+        char* page = r->map + pageno * ps;
+        mmap(page, ps, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+        __sync_fetch_and_or(&r->filled[pageno / 8], bit);
+    }
+    else if (!(r->filled[pageno / 8] & bit))
+    {
+        /* For example a write to a read-only mapping */
+        return 0;
+    }
+
+    snprintf(mapped_fault_name, sizeof(mapped_fault_name), "%s", r->name);
+    mapped_fault_offset = r->file_offset + (long long)(addr - r->data);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+/* Handle a fault at ``addr`` if it is the first access to a page of a
+ * lazy array: fill the page and make it readable. Return 1 if the
+ * fault was handled (execution can be resumed), 0 otherwise.
+ *
+ * On Linux, the page is filled in a temporary mapping which is then
+ * moved into place with mremap(). This way, other threads never see a
+ * partially filled page. Elsewhere, the page is filled in place. */
+static int lazy_fault(const char* addr)
+{
+#if HAVE_MMAP
+    cysigs_region_t* r = find_region(addr);
+    if (!r || r->kind != REGION_LAZY) return 0;
+
+    size_t ps = page_size();
+    size_t pageno = (size_t)(addr - r->map) / ps;
+    unsigned char bit = 1 << (pageno % 8);
+
+    /* An access to a filled page is a write to read-only memory */
+    if (r->filled[pageno / 8] & bit) return 0;
+
+    char* page = r->map + pageno * ps;
+    size_t offset = pageno * ps;
+    size_t len = r->size - offset;
+    if (len > ps) len = ps;
+
+#if defined(MREMAP_FIXED)
+    char* tmp = mmap(NULL, ps, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (tmp == MAP_FAILED) return 0;
+    r->fill(tmp, offset, len, r->fill_arg);
+    if (mprotect(tmp, ps, PROT_READ) ||
+        mremap(tmp, ps, ps, MREMAP_MAYMOVE|MREMAP_FIXED, page) == MAP_FAILED)
+    {
+        munmap(tmp, ps);
+        return 0;
+    }
+#else
+    if (mprotect(page, ps, PROT_READ|PROT_WRITE)) return 0;
+    r->fill(page, offset, len, r->fill_arg);
+    if (mprotect(page, ps, PROT_READ)) return 0;
+#endif
+    __sync_fetch_and_or(&r->filled[pageno / 8], bit);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+/* If ``addr`` lies inside a registered region, return an error
+ * message describing the invalid access. Otherwise, return NULL.
+ * This is called from the signal handler, so it cannot take locks. */
+static const char* region_fault_message(const char* addr)
+{
+    cysigs_region_t* r = find_region(addr);
+    if (!r) return NULL;
+
+    const char* what;
+    if (r->kind == REGION_LAZY)
+        what = "write access at byte offset %ld of read-only lazy array '%s' of size %lu";
+    else if (r->kind == REGION_FILE)
+        what = "invalid access at byte offset %ld of mapped file '%s' of size %lu";
+    else
+        what = "out-of-bounds access at byte offset %ld of guarded array '%s' of size %lu";
+    snprintf(region_fault_msg, sizeof(region_fault_msg), what,
+            (long)(addr - r->data), r->name, (unsigned long)r->size);
+    return region_fault_msg;
+}
+
+
+/* Page-aligned allocations with placement hints, see
+ * check_hugepage_alloc() and check_numa_alloc() in memory.pxd.
+ * These are mapped with mmap() and must be freed with
+ * _sig_mapped_free() with the same size. Without mmap(), they are
+ * allocated with calloc(), such that the memory is zeroed in both
+ * cases, and freed with free(). */
+#define HUGEPAGE_SIZE ((size_t)2 << 20)
+#define MAX_NUMA_NODES 1024
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+/* Map ``len`` bytes aligned to ``align`` (a multiple of the page
+ * size) by mapping more memory and unmapping the excess. */
+static char* map_aligned(size_t len, size_t align)
+{
+#if HAVE_MMAP
+    size_t maplen = len + align - page_size();
+    if (maplen < len) return NULL;
+    char* map = mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+
+    char* start = (char*)(((uintptr_t)map + align - 1) & ~(uintptr_t)(align - 1));
+    char* end = start + len;
+    if (start > map) munmap(map, start - map);
+    if (map + maplen > end) munmap(end, map + maplen - end);
+    return start;
+#else
+    return NULL;
+#endif
+}
+
+
+/* Allocate ``n`` bytes backed by transparent huge pages if possible.
+ * Allocations of at least one huge page are aligned to a huge page
+ * boundary and marked with MADV_HUGEPAGE. If the system does not
+ * support this, we silently get normal pages. Return NULL on failure.
+ *
+ * This must be called with interrupts blocked, see sig_block(). */
+static void* _sig_hugepage_malloc(size_t n)
+{
+#if HAVE_MMAP
+    size_t ps = page_size();
+    if (n == 0 || n > SIZE_MAX - HUGEPAGE_SIZE) return NULL;
+    size_t len = (n + ps - 1) & ~(ps - 1);
+    if (len < HUGEPAGE_SIZE) return map_aligned(len, ps);
+
+    char* ptr = map_aligned(len, HUGEPAGE_SIZE);
+#if HAVE_MADVISE && defined(MADV_HUGEPAGE)
+    if (ptr) madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+    return ptr;
+#else
+    return calloc(1, n);
+#endif
+}
+
+
+/* Allocate ``n`` bytes, preferably on NUMA node ``node``. If NUMA is
+ * not supported or there is no such node, the memory is allocated
+ * with the default policy. Return NULL on failure.
+ *
+ * This must be called with interrupts blocked, see sig_block(). */
+static void* _sig_numa_malloc(size_t n, int node)
+{
+#if HAVE_MMAP
+    size_t ps = page_size();
+    if (n == 0 || n > SIZE_MAX - ps) return NULL;
+    size_t len = (n + ps - 1) & ~(ps - 1);
+    char* ptr = map_aligned(len, ps);
+#if HAVE_SYSCALL && defined(SYS_mbind) && HAVE_LINUX_MEMPOLICY_H
+    if (ptr && node >= 0 && node < MAX_NUMA_NODES)
+    {
+        /* Bind before the memory is touched, such that all pages are
+         * allocated on the requested node */
+        unsigned long nodemask[MAX_NUMA_NODES / BITS_PER_LONG];
+        memset(nodemask, 0, sizeof(nodemask));
+        nodemask[node / BITS_PER_LONG] = 1UL << (node % BITS_PER_LONG);
+        syscall(SYS_mbind, ptr, len, MPOL_PREFERRED, nodemask, MAX_NUMA_NODES, 0);
+    }
+#endif
+    return ptr;
+#else
+    return calloc(1, n);
+#endif
+}
+
+
+/* Free memory of ``n`` bytes allocated by _sig_hugepage_malloc() or
+ * _sig_numa_malloc().
+ *
+ * This must be called with interrupts blocked, see sig_block(). */
+static void _sig_mapped_free(void* ptr, size_t n)
+{
+    if (ptr == NULL) return;
+#if HAVE_MMAP
+    size_t ps = page_size();
+    munmap(ptr, (n + ps - 1) & ~(ps - 1));
+#else
+    free(ptr);
+#endif
+}
+
+
+/* Shrinkers: callbacks which can free memory (for example by dropping
+ * caches) when an allocation fails, see sig_register_shrinker(). They
+ * are kept sorted by increasing priority. */
+#define MAX_SHRINKERS 64
+
+typedef struct
+{
+    sig_shrinker_func func;
+    void* arg;
+    int priority;
+} cysigs_shrinker_t;
+
+static cysigs_shrinker_t shrinkers[MAX_SHRINKERS];
+static int num_shrinkers = 0;
+static pthread_mutex_t shrinkers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Register ``func(needed, arg)`` to be called when an allocation of
+ * ``needed`` bytes fails. It should free memory and return the number
+ * of bytes freed (or an estimate, any non-zero value causes the
+ * allocation to be retried). Shrinkers with a lower priority are
+ * called first. Return 0 on success, -1 if too many shrinkers are
+ * registered. */
+static int sig_register_shrinker(sig_shrinker_func func, void* arg, int priority)
+{
+    pthread_mutex_lock(&shrinkers_lock);
+    if (num_shrinkers >= MAX_SHRINKERS)
+    {
+        pthread_mutex_unlock(&shrinkers_lock);
+        return -1;
+    }
+    int i = num_shrinkers++;
+    while (i > 0 && shrinkers[i-1].priority > priority)
+    {
+        shrinkers[i] = shrinkers[i-1];
+        i--;
+    }
+    shrinkers[i].func = func;
+    shrinkers[i].arg = arg;
+    shrinkers[i].priority = priority;
+    pthread_mutex_unlock(&shrinkers_lock);
+    return 0;
+}
+
+
+/* Unregister a shrinker registered with the same ``func`` and ``arg``.
+ * Return 0 on success, -1 if no such shrinker was registered. */
+static int sig_unregister_shrinker(sig_shrinker_func func, void* arg)
+{
+    pthread_mutex_lock(&shrinkers_lock);
+    int i;
+    for (i = 0; i < num_shrinkers; i++)
+    {
+        if (shrinkers[i].func == func && shrinkers[i].arg == arg)
+        {
+            num_shrinkers--;
+            for (; i < num_shrinkers; i++)
+                shrinkers[i] = shrinkers[i+1];
+            pthread_mutex_unlock(&shrinkers_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&shrinkers_lock);
+    return -1;
+}
+
+
+/* Call the shrinkers after an allocation of ``needed`` bytes failed.
+ * ``*cursor`` is the index of the next shrinker to call, it should be
+ * initialized to 0. Shrinkers are called in order until one of them
+ * frees memory: then return 1 such that the caller can retry the
+ * allocation. Return 0 when all shrinkers have been called.
+ *
+ * Interrupts are blocked while the shrinkers run. */
+static int sig_shrink_memory(size_t needed, int* cursor)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&shrinkers_lock);
+        if (*cursor >= num_shrinkers)
+        {
+            pthread_mutex_unlock(&shrinkers_lock);
+            return 0;
+        }
+        cysigs_shrinker_t s = shrinkers[(*cursor)++];
+        pthread_mutex_unlock(&shrinkers_lock);
+
+        /* Like sig_block()/sig_unblock() from macros.h */
+        ++cysigs.block_sigint;
+        size_t freed = s.func(needed, s.arg);
+        --cysigs.block_sigint;
+        if (cysigs.interrupt_received && cysigs.sig_on_count > 0 && cysigs.block_sigint == 0)
+            raise(cysigs.interrupt_received);
+
+        if (freed) return 1;
+    }
+}
+
+
+/* Allocation accounting for sig_on_quota(). While a region is active,
+ * the sig_malloc() family in memory.pxd reports the usable size of the
+ * blocks allocated and freed by the thread which started the region.
+ * An allocation which would make the net allocated size exceed the
+ * quota raises MemoryError. Without malloc_usable_size(), nothing is
+ * accounted.
+ *
+ * The region, including the sig_on() level at which it ends, is kept
+ * per thread, so regions of different threads do not mix;
+ * cysigs.quota_depth only counts the active regions such that the
+ * sig_malloc() family can skip the accounting when there are none.
+ * Without thread-local storage, there is a single state which belongs
+ * to the thread which started the last region. */
+typedef struct
+{
+    /* Value of sig_on_count inside the region, 0 if there is none */
+    int depth;
+#ifndef CYSIGNALS_THREAD_LOCAL
+    pthread_t thread;
+#endif
+    size_t limit;
+    long long current;
+    long long peak;
+} cysigs_quota_t;
+
+#ifdef CYSIGNALS_THREAD_LOCAL
+static CYSIGNALS_THREAD_LOCAL cysigs_quota_t quota;
+#else
+static cysigs_quota_t quota;
+#endif
+
+
+/* Did the calling thread start the active region? */
+static inline int quota_owned(void)
+{
+#ifdef CYSIGNALS_THREAD_LOCAL
+    return quota.depth != 0;
+#else
+    return quota.depth != 0 && pthread_equal(quota.thread, pthread_self());
+#endif
+}
+
+
+/* Start a region inside the current sig_on() with a quota of ``quota``
+ * bytes (0 for no limit). This replaces the active region, if any. */
+static int _sig_quota_begin(size_t limit)
+{
+#if HAVE_MALLOC_USABLE_SIZE
+    if (!quota.depth) __sync_add_and_fetch(&cysigs.quota_depth, 1);
+    quota.depth = cysigs.sig_on_count;
+#ifndef CYSIGNALS_THREAD_LOCAL
+    quota.thread = pthread_self();
+#endif
+    quota.limit = limit;
+    quota.current = 0;
+    quota.peak = 0;
+#endif
+    return 1;
+}
+
+
+/* End the region of the calling thread if it is deeper than the
+ * sig_on() level ``depth`` (when sig_off() or a jump leaves it) */
+static void _sig_quota_close(int depth)
+{
+    if (quota_owned() && quota.depth > depth)
+    {
+        quota.depth = 0;
+        __sync_sub_and_fetch(&cysigs.quota_depth, 1);
+    }
+}
+
+
+/* Size to account for the block ``ptr`` (0 for NULL) */
+static size_t _sig_quota_size(void* ptr)
+{
+#if HAVE_MALLOC_USABLE_SIZE
+    if (ptr && quota_owned())
+        return malloc_usable_size(ptr);
+#endif
+    return 0;
+}
+
+
+/* Would allocating ``n`` bytes, replacing a block of ``old`` bytes,
+ * exceed the quota? */
+static int _sig_quota_exceeds(size_t n, size_t old)
+{
+    if (!quota.limit || !quota_owned())
+        return 0;
+    if (n > quota.limit) return 1;
+    return quota.current - (long long)old + (long long)n > (long long)quota.limit;
+}
+
+
+/* Account for allocating ``added`` and freeing ``removed`` bytes */
+static void _sig_quota_update(size_t added, size_t removed)
+{
+    if (!added && !removed) return;
+    quota.current += (long long)added - (long long)removed;
+    if (quota.current > quota.peak) quota.peak = quota.current;
+}
+
+
+/* Net and peak net size allocated in the active or last region of the
+ * calling thread */
+static long long sig_quota_current(void)
+{
+    return quota.current;
+}
+
+static long long sig_quota_peak(void)
+{
+    return quota.peak;
+}
+
+
+/* Additional platform-specific implementation code */
+#if defined(__CYGWIN__)
+#include "implementation_cygwin.c"
+#endif
+
+
+/* Interrupt protocols of third-party libraries. Like PARI, a library
+ * may have its own flag telling that it is inside a critical section
+ * (typically around its memory management) and a flag storing an
+ * interrupt which was deferred because of this. Such a library can
+ * register both flags with sig_register_protocol():
+ *
+ * - while *block is non-zero, interrupts inside sig_on() are deferred
+ *   as if sig_block() was called, and *pending is set to the signal
+ *   number. It is the responsibility of the library to re-raise the
+ *   signal when leaving its critical section, like sig_unblock().
+ *
+ * - after jumping back to sig_on(), *block and *pending are reset to
+ *   zero and the optional recover(arg) is called.
+ *
+ * PARI is registered this way by setup_cysignals_handlers(). The
+ * signal handler reads the table without locking, so protocols
+ * should be registered during initialization of the library. */
+#define MAX_PROTOCOLS 16
+
+typedef struct
+{
+    volatile int* block;
+    volatile int* pending;
+    sig_recover_func recover;
+    void* arg;
+} cysigs_protocol_t;
+
+static cysigs_protocol_t protocols[MAX_PROTOCOLS];
+static volatile int num_protocols = 0;
+static pthread_mutex_t protocols_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Register a protocol. Return 0 on success, -1 if the table is full
+ * or the flags are already registered. */
+static int sig_register_protocol(int* block, int* pending, sig_recover_func recover, void* arg)
+{
+    int i, ret = -1;
+    pthread_mutex_lock(&protocols_lock);
+    for (i = 0; i < num_protocols; i++)
+        if (protocols[i].block == block) goto out;
+    for (i = 0; i < MAX_PROTOCOLS; i++)
+    {
+        if (protocols[i].block) continue;
+        protocols[i].pending = pending;
+        protocols[i].recover = recover;
+        protocols[i].arg = arg;
+        /* Set block last: the signal handler skips entries without it */
+        protocols[i].block = block;
+        if (i >= num_protocols) num_protocols = i + 1;
+        ret = 0;
+        break;
+    }
+out:
+    pthread_mutex_unlock(&protocols_lock);
+    return ret;
+}
+
+
+/* Unregister the protocol with the given block flag. Return 0 on
+ * success, -1 if it was not registered. */
+static int sig_unregister_protocol(int* block)
+{
+    int i, ret = -1;
+    pthread_mutex_lock(&protocols_lock);
+    for (i = 0; i < num_protocols; i++)
+    {
+        if (protocols[i].block != block) continue;
+        protocols[i].block = NULL;
+        ret = 0;
+        break;
+    }
+    pthread_mutex_unlock(&protocols_lock);
+    return ret;
+}
+
+
+/* Is any registered library inside a critical section? */
+static inline int protocols_blocked(void)
+{
+    int i;
+    for (i = 0; i < num_protocols; i++)
+    {
+        volatile int* block = protocols[i].block;
+        if (block && *block) return 1;
+    }
+    return 0;
+}
+
+
+/* Store a deferred interrupt in all registered pending flags */
+static inline void protocols_set_pending(int sig)
+{
+    int i;
+    for (i = 0; i < num_protocols; i++)
+        if (protocols[i].block && protocols[i].pending)
+            *protocols[i].pending = sig;
+}
+
+
+/* Reset the flags after jumping back to sig_on() or handling a
+ * deferred interrupt. If "recover" is non-zero, also reset the block
+ * flags and call the recover functions. */
+static void protocols_reset(int recover)
+{
+    int i;
+    for (i = 0; i < num_protocols; i++)
+    {
+        cysigs_protocol_t* p = &protocols[i];
+        if (!p->block) continue;
+        if (p->pending) *p->pending = 0;
+        if (!recover) continue;
+        *p->block = 0;
+        if (p->recover) p->recover(p->arg);
+    }
+}
+
+
+/* Stall watchdog. An interrupt received inside sig_block() (or inside
+ * the critical section of a registered library) is only handled when the blocked section ends.
+ * The watchdog thread measures how long an interrupt has been pending
+ * inside sig_on(). After "warn" seconds, it prints a diagnostic with
+ * the sig_str() message and the location of the sig_on(). After
+ * "grace" seconds (if positive), it escalates according to "action":
+ *
+ * - WATCHDOG_LOG: do nothing more.
+ *
+ * - WATCHDOG_INTERRUPT: jump back to sig_on() despite the blocking.
+ *   This is unsafe if the blocked code holds locks or leaves data in
+ *   an inconsistent state, but bounds the latency of interrupts.
+ *
+ * - WATCHDOG_TERMINATE: send SIGTERM to the process. */
+#define WATCHDOG_LOG       0
+#define WATCHDOG_INTERRUPT 1
+#define WATCHDOG_TERMINATE 2
+
+static struct
+{
+    double warn;
+    double grace;
+    int action;
+    volatile int stop;
+    int running;
+    pthread_t thread;
+} watchdog;
+
+/* Set by the watchdog to make cysigs_interrupt_handler() jump even
+ * inside sig_block(). Reset by _sig_on_recover(). */
+static volatile sig_atomic_t watchdog_force = 0;
+
+/* Thread which received the pending interrupt inside sig_on() */
+static pthread_t interrupt_thread;
+
+
+static double watchdog_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+static void* watchdog_main(void* arg)
+{
+    double poll = watchdog.warn;
+    if (watchdog.grace > 0 && watchdog.grace < poll) poll = watchdog.grace;
+    poll /= 10;
+    if (poll < 0.001) poll = 0.001;
+    if (poll > 0.1) poll = 0.1;
+
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = poll * 1e9;
+
+    double since = -1;
+    int logged = 0, escalated = 0;
+    while (!watchdog.stop)
+    {
+        nanosleep(&ts, NULL);
+
+        if (!(cysigs.interrupt_received && cysigs.sig_on_count > 0))
+        {
+            since = -1;
+            continue;
+        }
+
+        double now = watchdog_time();
+        if (since < 0)
+        {
+            since = now;
+            logged = escalated = 0;
+        }
+
+        if (!logged && now - since >= watchdog.warn)
+        {
+            logged = 1;
+            const char* msg = cysigs.s;
+            fprintf(stderr, "cysignals watchdog: interrupt pending for %.3f seconds inside sig_on() at %s:%i%s%s\n",
+                    now - since, cysigs.file ? cysigs.file : "?", cysigs.line,
+                    msg ? ": " : "", msg ? msg : "");
+            fflush(stderr);
+        }
+
+        if (!escalated && watchdog.grace > 0 && now - since >= watchdog.grace)
+        {
+            escalated = 1;
+            if (watchdog.action == WATCHDOG_INTERRUPT)
+            {
+                fprintf(stderr, "cysignals watchdog: forcing interrupt\n");
+                fflush(stderr);
+                watchdog_force = 1;
+                pthread_kill(interrupt_thread, cysigs.interrupt_received);
+            }
+            else if (watchdog.action == WATCHDOG_TERMINATE)
+            {
+                fprintf(stderr, "cysignals watchdog: sending SIGTERM\n");
+                fflush(stderr);
+#if HAVE_KILL
+                kill(getpid(), SIGTERM);
+#endif
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/* Start the watchdog thread. Return 0 on success, -1 if it is already
+ * running or if the thread could not be created. */
+static int sig_watchdog_start(double warn, double grace, int action)
+{
+    if (watchdog.running) return -1;
+    watchdog.warn = warn;
+    watchdog.grace = grace;
+    watchdog.action = action;
+    watchdog.stop = 0;
+
+    /* The watchdog thread should not receive any signals */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&watchdog.thread, NULL, watchdog_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) return -1;
+
+    watchdog.running = 1;
+    return 0;
+}
+
+
+/* Stop the watchdog thread if it is running */
+static void sig_watchdog_stop(void)
+{
+    if (!watchdog.running) return;
+    watchdog.stop = 1;
+    pthread_join(watchdog.thread, NULL);
+    watchdog.running = 0;
+}
+
+
+/* Cooperative yielding. A timer thread periodically sets
+ * cysigs.yield_requested. The next sig_check() then calls _sig_yield(),
+ * which runs the Python callbacks registered with
+ * register_yield_callback() (for progress reporting or heartbeats)
+ * and resumes the computation. */
+static struct
+{
+    double interval;
+    volatile int stop;
+    int running;
+    pthread_t thread;
+} yield_timer;
+
+
+static void* yield_timer_main(void* arg)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)yield_timer.interval;
+    ts.tv_nsec = (yield_timer.interval - ts.tv_sec) * 1e9;
+
+    while (!yield_timer.stop)
+    {
+        nanosleep(&ts, NULL);
+        cysigs.yield_requested = 1;
+    }
+    return NULL;
+}
+
+
+/* Start the timer thread with the given interval in seconds, or stop
+ * it if the interval is not positive. Return 0 on success, -1 if the
+ * thread could not be created. */
+static int sig_set_yield_interval(double interval)
+{
+    if (yield_timer.running)
+    {
+        yield_timer.stop = 1;
+        pthread_join(yield_timer.thread, NULL);
+        yield_timer.running = 0;
+    }
+    if (!(interval > 0)) return 0;
+
+    yield_timer.interval = interval;
+    yield_timer.stop = 0;
+
+    /* The timer thread should not receive any signals */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&yield_timer.thread, NULL, yield_timer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) return -1;
+
+    yield_timer.running = 1;
+    return 0;
+}
+
+
+/* Called by sig_check() when cysigs.yield_requested is set */
+static void _sig_yield(void)
+{
+    /* Set while the callbacks run, such that a sig_check() in a
+     * callback or in another thread does not run them again */
+    static volatile int inside = 0;
+
+    cysigs.yield_requested = 0;
+    if (!__sync_bool_compare_and_swap(&inside, 0, 1)) return;
+
+    /* Interrupts are deferred while the callbacks run, like in
+     * sig_block()/sig_unblock() */
+    ++cysigs.block_sigint;
+    sig_run_yield_callbacks();
+    --cysigs.block_sigint;
+    __sync_lock_release(&inside);
+
+    if (unlikely(cysigs.interrupt_received))
+        if (cysigs.sig_on_count > 0 && cysigs.block_sigint == 0)
+            raise(cysigs.interrupt_received);
+}
+
+
+/* Watcher of the cancellation flags. A cancellation is a store to
+ * shared memory which does not come with a signal, so a thread polls
+ * the watched flags every 10 milliseconds and sets
+ * cysigs.yield_requested when the current job is cancelled. Then
+ * sig_check() only needs to test cysigs.yield_requested and handles
+ * the cancellation on its slow path. A thread does not survive fork(),
+ * so a watcher started by the parent process does not run in a child. */
+static struct
+{
+    volatile int stop;
+    int running;
+    pid_t pid;
+    pthread_t thread;
+} cancel_watcher;
+
+
+static void* cancel_watcher_main(void* arg)
+{
+    struct timespec ts = {0, 10000000};
+    while (!cancel_watcher.stop)
+    {
+        nanosleep(&ts, NULL);
+        if (_sig_cancel_requested()) cysigs.yield_requested = 1;
+    }
+    return NULL;
+}
+
+
+/* Start the watcher thread in this process if it is not running yet,
+ * or stop it. Return 0 on success, -1 if the thread could not be
+ * created. */
+static int sig_set_cancel_watcher(int on)
+{
+    if (cancel_watcher.running && cancel_watcher.pid != getpid())
+        cancel_watcher.running = 0;
+
+    if (!on)
+    {
+        if (!cancel_watcher.running) return 0;
+        cancel_watcher.stop = 1;
+        pthread_join(cancel_watcher.thread, NULL);
+        cancel_watcher.running = 0;
+        return 0;
+    }
+    if (cancel_watcher.running) return 0;
+
+    cancel_watcher.stop = 0;
+
+    /* The watcher thread should not receive any signals */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&cancel_watcher.thread, NULL, cancel_watcher_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) return -1;
+
+    cancel_watcher.pid = getpid();
+    cancel_watcher.running = 1;
+    return 0;
+}
+
+
+/* Control channel. A process can be sent commands as real-time
+ * signals with a payload using sigqueue(). For each signal subscribed
+ * with subscribe_control() from Python, cysigs_control_handler() is
+ * installed on top of the Python-level signal handler. It stores the
+ * signal, payload and sender in a lock-free queue and then calls the
+ * Python handler, which drains the queue and runs the subscribed
+ * callbacks. It also sets cysigs.yield_requested, such that the queue
+ * is drained by sig_check() inside long computations too. */
+#define CONTROL_QUEUE_LEN 256
+#ifndef NSIG
+#define NSIG 65
+#endif
+
+typedef struct
+{
+    volatile int ready;
+    int signum;
+    int value;
+    long pid;
+    long uid;
+} cysigs_control_event_t;
+
+static cysigs_control_event_t control_queue[CONTROL_QUEUE_LEN];
+static volatile unsigned long control_head = 0;
+static volatile unsigned long control_tail = 0;
+static volatile unsigned long control_dropped = 0;
+
+/* Handlers which were installed before cysigs_control_handler() */
+static struct sigaction control_chain[NSIG];
+
+
+static void cysigs_control_handler(int sig, siginfo_t* info, void* context)
+{
+    /* Reserve a slot. The handler may interrupt itself for a different
+     * signal, hence the compare-and-swap. */
+    unsigned long tail;
+    for (;;)
+    {
+        tail = control_tail;
+        if (tail - control_head >= CONTROL_QUEUE_LEN)
+        {
+            __sync_fetch_and_add(&control_dropped, 1);
+            goto chain;
+        }
+        if (__sync_bool_compare_and_swap(&control_tail, tail, tail + 1))
+            break;
+    }
+
+    cysigs_control_event_t* e = &control_queue[tail % CONTROL_QUEUE_LEN];
+    e->signum = sig;
+    e->value = info ? info->si_value.sival_int : 0;
+    e->pid = info ? (long)info->si_pid : 0;
+    e->uid = info ? (long)info->si_uid : 0;
+    __sync_synchronize();
+    e->ready = 1;
+
+    cysigs.yield_requested = 1;
+
+chain:
+    /* Let Python know that the signal arrived */
+    if (control_chain[sig].sa_flags & SA_SIGINFO)
+        control_chain[sig].sa_sigaction(sig, info, context);
+    else if (control_chain[sig].sa_handler != SIG_DFL &&
+             control_chain[sig].sa_handler != SIG_IGN)
+        control_chain[sig].sa_handler(sig);
+}
+
+
+/* Install cysigs_control_handler() for signal ``sig``, chaining to the
+ * current handler. Return 0 on success, -1 on error (with errno set). */
+static int sig_control_install(int sig)
+{
+    if (sig <= 0 || sig >= NSIG) {errno = EINVAL; return -1;}
+
+    struct sigaction sa, old;
+    if (sigaction(sig, NULL, &old)) return -1;
+    if ((old.sa_flags & SA_SIGINFO) && old.sa_sigaction == cysigs_control_handler)
+        return 0;
+    control_chain[sig] = old;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = cysigs_control_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    return sigaction(sig, &sa, NULL);
+}
+
+
+/* Restore the handler which was replaced by sig_control_install() */
+static int sig_control_uninstall(int sig)
+{
+    if (sig <= 0 || sig >= NSIG) {errno = EINVAL; return -1;}
+    return sigaction(sig, &control_chain[sig], NULL);
+}
+
+
+/* Take the oldest event from the queue. Return 1 if there was one, 0
+ * otherwise. There must be only one consumer at a time (in practice,
+ * this is called with the GIL). */
+static int sig_control_pop(int* signum, int* value, long* pid, long* uid)
+{
+    cysigs_control_event_t* e = &control_queue[control_head % CONTROL_QUEUE_LEN];
+    if (!e->ready) return 0;
+    __sync_synchronize();
+    *signum = e->signum;
+    *value = e->value;
+    *pid = e->pid;
+    *uid = e->uid;
+    e->ready = 0;
+    __sync_synchronize();
+    control_head++;
+    return 1;
+}
+
+
+/* Send a control event with payload "value" to process "pid" */
+static int sig_control_send(long pid, int sig, int value)
+{
+#if HAVE_SIGQUEUE
+    union sigval v;
+    v.sival_int = value;
+    return sigqueue((pid_t)pid, sig, v);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 
-#if HAVE_SIGPROCMASK
-/* The default signal mask during normal operation,
- * initialized by setup_cysignals_handlers(). */
-static sigset_t default_sigmask;
+/* Number of events dropped because the queue was full */
+static unsigned long sig_control_dropped(void)
+{
+    return control_dropped;
+}
 
-/* default_sigmask with SIGHUP, SIGINT, SIGALRM added. */
-static sigset_t sigmask_with_sigint;
-#endif
 
-/* A trampoline to jump to after handling a signal. */
-static cyjmp_buf trampoline_setup;
-static sigjmp_buf trampoline;
+/* Waits of the blocking primitives in sync.h. A thread waiting for a
+ * wakeup on a sequence word registers the word in the waiters table.
+ * When an interrupt becomes pending, cysigs_interrupt_handler()
+ * increments all registered words and wakes their waiters, which then
+ * notice the interrupt. Since _sig_futex_wait() checks for an
+ * interrupt after registering and futex() only sleeps while the word
+ * is unchanged, there is no window in which a wakeup can be lost.
+ *
+ * The word usually lives on the stack of the waiting thread, so it
+ * must not be touched after the slot is released. Therefore
+ * waiters_wake() marks the slot as busy while using the word and
+ * waiter_release() waits until it is no longer busy. */
+#define MAX_WAITERS 64
 
-static void setup_cysignals_handlers(void);
-static void cysigs_interrupt_handler(int sig);
-static void cysigs_signal_handler(int sig);
+typedef struct
+{
+    volatile int* word;
+    pthread_t thread;
+    volatile int busy;
+} cysigs_waiter_t;
 
-static void do_raise_exception(int sig);
-static void sigdie(int sig, const char* s);
+static cysigs_waiter_t waiters[MAX_WAITERS];
 
-#define BACKTRACELEN 1024
-static void print_backtrace(void);
 
-/* Implemented in signals.pyx */
-static int sig_raise_exception(int sig, const char* msg);
+static int waiter_register(volatile int* word)
+{
+    int i;
+    for (i = 0; i < MAX_WAITERS; i++)
+    {
+        if (waiters[i].word) continue;
+        if (__sync_bool_compare_and_swap(&waiters[i].word, NULL, word))
+        {
+            waiters[i].thread = pthread_self();
+            return i;
+        }
+    }
+    return -1;
+}
 
 
-/* Do whatever is needed to reset the CPU to a sane state after
- * handling a signals.  In particular on x86 CPUs, we need to clear
- * the FPU (this is needed after MMX instructions have been used or
- * if an interrupt occurs during an FPU computation).
- * Linux and OS X 10.6 do this as part of their signals implementation,
- * but Solaris doesn't.  Since this code is called only when handling a
- * signal (which should be very rare), it's better to play safe and
- * always execute this instead of special-casing based on the operating
- * system.
- * See http://trac.sagemath.org/sage_trac/ticket/12873
- */
-static inline void reset_CPU(void)
+/* Called by cysigs_interrupt_handler() after storing a pending
+ * interrupt */
+static void waiters_wake(void)
 {
-#if HAVE_EMMS
-    /* Clear FPU tag word */
-    asm("emms");
+    int i;
+    for (i = 0; i < MAX_WAITERS; i++)
+    {
+        __sync_fetch_and_add(&waiters[i].busy, 1);
+        volatile int* word = waiters[i].word;
+        if (word)
+        {
+            __sync_fetch_and_add(word, 1);
+#if HAVE_FUTEX
+            syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
 #endif
+        }
+        __sync_fetch_and_sub(&waiters[i].busy, 1);
+    }
 }
 
 
-/* Reset all signal handlers and the signal mask to their defaults. */
-static inline void sig_reset_defaults(void) {
-    signal(SIGHUP, SIG_DFL);
-    signal(SIGINT, SIG_DFL);
-    signal(SIGQUIT, SIG_DFL);
-    signal(SIGILL, SIG_DFL);
-    signal(SIGABRT, SIG_DFL);
-    signal(SIGFPE, SIG_DFL);
-    signal(SIGBUS, SIG_DFL);
-    signal(SIGSEGV, SIG_DFL);
-    signal(SIGALRM, SIG_DFL);
-    signal(SIGTERM, SIG_DFL);
-#if HAVE_SIGPROCMASK
-    sigprocmask(SIG_SETMASK, &default_sigmask, NULL);
-#endif
+/* Release slot i, after which its word may be freed */
+static void waiter_release(int i)
+{
+    waiters[i].word = NULL;
+    __sync_synchronize();
+    while (waiters[i].busy) { }
 }
 
 
-/* Call sigdie() with the appropriate error message for the signal, or
- * whether the exception occurred inside our signal handler */
-static inline void sigdie_for_sig(int sig, int inside)
+/* Release the registrations of this thread after jumping out of
+ * _sig_futex_wait() */
+static void waiters_release_thread(void)
 {
-    sig_reset_defaults();
+    int i;
+    pthread_t self = pthread_self();
+    for (i = 0; i < MAX_WAITERS; i++)
+        if (waiters[i].word && pthread_equal(waiters[i].thread, self))
+            waiter_release(i);
+}
 
-    /* Quit Python with an appropriate message.
-       Make sure to check the standard signals from the C standard first,
-       in case systems alias some of these constants. */
-    if (inside)
-        sigdie(sig, "An error occurred during signal handling.");
-    else if (sig == SIGILL)
-        sigdie(sig, "Unhandled SIGILL: An illegal instruction occurred.");
-    else if (sig == SIGABRT)
-        sigdie(sig, "Unhandled SIGABRT: An abort() occurred.");
-    else if (sig == SIGFPE)
-        sigdie(sig, "Unhandled SIGFPE: An unhandled floating point exception occurred.");
-    else if (sig == SIGSEGV)
-        sigdie(sig, "Unhandled SIGSEGV: A segmentation fault occurred.");
-    else if (sig == SIGBUS)
-        sigdie(sig, "Unhandled SIGBUS: A bus error occurred.");
-    else if (sig == SIGQUIT)
-        sigdie(sig, NULL);
-    else
-        sigdie(sig, "Unknown signal received.");
+
+/* Is there an interrupt which a wait should react to? In the thread
+ * inside sig_on(), interrupts inside sig_block() are only handled by
+ * sig_unblock(). Other threads react to any pending interrupt. */
+static inline int waiter_interrupted(void)
+{
+    return cysigs.interrupt_received &&
+        !(cysigs.sig_on_count > 0 && cysigs.block_sigint &&
+          pthread_equal(cysigs.thread, pthread_self()));
 }
 
 
-/* Additional platform-specific implementation code */
-#if defined(__CYGWIN__)
-#include "implementation_cygwin.c"
+/* Raise the exception for the pending interrupt in a thread other than
+ * the one inside sig_on(), see _sig_sync_interrupted() in sync.h. The
+ * interrupt stays pending for the thread inside sig_on(). */
+static void _sig_raise_pending(void)
+{
+    int sig = cysigs.interrupt_received;
+    if (sig) sig_raise_exception(sig, NULL);
+}
+
+
+/* Wait until the sequence word *word is no longer equal to val (or
+ * until a spurious wakeup). Return 0 if an interrupt is pending, 1
+ * otherwise. Other threads may increment *word at any time, so it must
+ * not store anything else than a sequence number. */
+static int _sig_futex_wait(int* w, int val)
+{
+    volatile int* word = w;
+    int ret = 1;
+    int slot = waiter_register(word);
+    __sync_synchronize();
+
+    if (waiter_interrupted())
+        ret = 0;
+    else if (*word == val)
+    {
+        /* Without a slot in the waiters table (or without futex), we
+         * poll for interrupts */
+        struct timespec ts = {0, 10000000};
+#if HAVE_FUTEX
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val,
+                (slot < 0) ? &ts : NULL, NULL, 0);
+#else
+        nanosleep(&ts, NULL);
+#endif
+        if (waiter_interrupted()) ret = 0;
+    }
+
+    if (slot >= 0) waiter_release(slot);
+    return ret;
+}
+
+
+/* Wake up to n threads waiting on *word */
+static void _sig_futex_wake(int* word, int n)
+{
+#if HAVE_FUTEX
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
 #endif
+}
+
+
+/* Choose the jump buffer for a signal handled inside sig_on() and
+ * close the sig_on_local() scopes which are left. Critical signals go
+ * to the innermost sig_on_local() scope, interrupts to the innermost
+ * one with the SIG_LOCAL_INTERRUPTS flag. Otherwise, jump back to the
+ * outermost sig_on(). */
+static cyjmp_buf* sig_jump_target(int interrupt)
+{
+    int d = cysigs.local_depth;
+    if (d > SIG_LOCAL_MAX) d = SIG_LOCAL_MAX;
+
+    while (d > 0)
+    {
+        cysigs_local_t* l = &cysigs.local[d - 1];
+        /* An outermost sig_on_local() uses cysigs.env */
+        if (l->sig_on_count == 0) break;
+        if (!interrupt || (l->flags & SIG_LOCAL_INTERRUPTS))
+        {
+            cysigs.local_depth = d - 1;
+            return &l->env;
+        }
+        d--;
+    }
+    /* An outermost sig_on_local() finds itself as cysigs.local[0] */
+    cysigs.local_depth = 0;
+    return &cysigs.env;
+}
 
 
 /* Handler for SIGHUP, SIGINT, SIGALRM
@@ -181,11 +1678,13 @@ static inline void sigdie_for_sig(int sig, int inside)
  * raises an exception and jumps back to sig_on().
  * Outside of sig_on(), we set Python's interrupt flag using
  * PyErr_SetInterrupt() */
-static void cysigs_interrupt_handler(int sig)
+static void cysigs_interrupt_handler(int sig, siginfo_t* info, void* context)
 {
 #if ENABLE_DEBUG_CYSIGNALS
     if (cysigs.debug_level >= 1) {
-        fprintf(stderr, "\n*** SIG %i *** %s sig_on\n", sig, (cysigs.sig_on_count > 0) ? "inside" : "outside");
+        fprintf(stderr, "\n*** SIG %i *** %s sig_on", sig, (cysigs.sig_on_count > 0) ? "inside" : "outside");
+        if (info && info->si_code <= 0) fprintf(stderr, " (sent by pid %li)", (long)info->si_pid);
+        fprintf(stderr, "\n");
         if (cysigs.debug_level >= 3) print_backtrace();
         fflush(stderr);
         /* Store time of this signal, unless there is already a
@@ -194,14 +1693,18 @@ static void cysigs_interrupt_handler(int sig)
     }
 #endif
 
+    CYSIGNALS_PROBE(interrupt, sig, cysigs.sig_on_count, cysigs.block_sigint);
+
     if (cysigs.sig_on_count > 0)
     {
-        if (!cysigs.block_sigint && !PARI_SIGINT_block)
+        if ((!cysigs.block_sigint && !protocols_blocked()) || watchdog_force)
         {
             /* Raise an exception so Python can see it */
             do_raise_exception(sig);
 
-            /* Jump back to sig_on() (the first one if there is a stack) */
+            /* Jump back to the first sig_on() if there is a stack,
+             * unless a sig_on_local() handles interrupts */
+            trampoline_target = sig_jump_target(1);
             siglongjmp(trampoline, sig);
         }
     }
@@ -218,8 +1721,10 @@ static void cysigs_interrupt_handler(int sig)
      * don't overwrite a SIGHUP or SIGTERM which we already received. */
     if (cysigs.interrupt_received != SIGHUP && cysigs.interrupt_received != SIGTERM)
     {
+        interrupt_thread = pthread_self();
         cysigs.interrupt_received = sig;
-        PARI_SIGINT_pending = sig;
+        protocols_set_pending(sig);
+        waiters_wake();
     }
 }
 
@@ -227,9 +1732,20 @@ static void cysigs_interrupt_handler(int sig)
  *
  * Inside sig_on() (i.e. when cysigs.sig_on_count is positive), this
  * raises an exception and jumps back to sig_on().
- * Outside of sig_on(), we terminate Python. */
-static void cysigs_signal_handler(int sig)
+ * Outside of sig_on(), we terminate Python.
+ *
+ * A SIGSEGV or SIGBUS caused by the first access to a page of a lazy
+ * array is handled by filling that page, both inside and outside of
+ * sig_on(). For other faults inside a registered region (for example
+ * the guard pages of a guarded array), the exception message names
+ * the array. */
+static void cysigs_signal_handler(int sig, siginfo_t* info, void* context)
 {
+    if ((sig == SIGSEGV || sig == SIGBUS) && info && lazy_fault(info->si_addr))
+        return;
+
+    CYSIGNALS_PROBE(signal, sig, cysigs.sig_on_count, cysigs.s);
+
     sig_atomic_t inside = cysigs.inside_signal_handler;
     cysigs.inside_signal_handler = 1;
 
@@ -245,10 +1761,26 @@ static void cysigs_signal_handler(int sig)
         }
 #endif
 
+        int exc_sig = sig;
+        if ((sig == SIGSEGV || sig == SIGBUS) && info)
+        {
+            if (file_fault(sig, info->si_addr))
+            {
+                exc_sig = SIG_MAPPED_FILE;
+            }
+            else
+            {
+                const char* msg = region_fault_message(info->si_addr);
+                if (msg) cysigs.s = msg;
+            }
+        }
+
         /* Raise an exception so Python can see it */
-        do_raise_exception(sig);
+        do_raise_exception(exc_sig);
 
-        /* Jump back to sig_on() (the first one if there is a stack) */
+        /* Jump back to the innermost sig_on_local() or to the first
+         * sig_on() */
+        trampoline_target = sig_jump_target(0);
         siglongjmp(trampoline, sig);
     }
     else
@@ -305,7 +1837,7 @@ static void* _sig_on_trampoline(void* dummy)
 
     sig = sigsetjmp(trampoline, 1);
     reset_CPU();
-    cylongjmp(cysigs.env, sig);
+    cylongjmp(*trampoline_target, sig);
 }
 
 
@@ -363,11 +1895,36 @@ static void do_raise_exception(int sig)
     }
 #endif
 
+    CYSIGNALS_PROBE(raise, sig, cysigs.s);
+
     /* Call Cython function to raise exception */
     sig_raise_exception(sig, cysigs.s);
 }
 
 
+/* Can the cached exception instance "exc" be raised again by
+ * sig_raise_exception()? This requires that it is only referenced by
+ * the cache and possibly by cysigs.exc_value (so the previous raise
+ * has been dealt with) and that it has not been modified. Then its
+ * traceback is cleared. This must be called with the GIL. */
+static int sig_exception_reusable(PyObject* exc)
+{
+    PyBaseExceptionObject* e = (PyBaseExceptionObject*)exc;
+    Py_ssize_t refs = (exc == cysigs.exc_value) ? 2 : 1;
+    if (Py_REFCNT(exc) != refs) return 0;
+    if (e->dict && PyDict_Size(e->dict)) return 0;
+    if (!PyTuple_Check(e->args) || PyTuple_GET_SIZE(e->args)) return 0;
+#if PY_MAJOR_VERSION >= 3
+    if (e->context || e->cause || e->suppress_context) return 0;
+#if PY_VERSION_HEX >= 0x030B0000
+    if (e->notes) return 0;
+#endif
+    Py_CLEAR(e->traceback);
+#endif
+    return 1;
+}
+
+
 /* This will be called during _sig_on_postjmp() when an interrupt was
  * received *before* the call to sig_on(). */
 static void _sig_on_interrupt_received(void)
@@ -380,23 +1937,69 @@ static void _sig_on_interrupt_received(void)
 
     do_raise_exception(cysigs.interrupt_received);
     cysigs.sig_on_count = 0;
+    cysigs.local_depth = 0;
     cysigs.interrupt_received = 0;
-    PARI_SIGINT_pending = 0;
+    protocols_reset(0);
 
 #if HAVE_SIGPROCMASK
     sigprocmask(SIG_SETMASK, &oldset, NULL);
 #endif
 }
 
+/* This will be called by sig_on() or sig_check() when a cancellation
+ * flag is set. Raise CancelInterrupt and stop watching the flags, such
+ * that the cancellation is reported only once. Inside sig_on(), jump
+ * back to sig_on() like for an interrupt. */
+static void _sig_on_cancelled(void)
+{
+    cysigs.cancel_flags = NULL;
+    do_raise_exception(SIG_CANCEL);
+
+    if (cysigs.sig_on_count > 0)
+        cylongjmp(*sig_jump_target(1), SIG_CANCEL);
+
+    cysigs.local_depth = 0;
+    protocols_reset(0);
+}
+
 /* Cleanup after cylongjmp() (reset signal mask to the default, set
  * sig_on_count to zero) */
 static void _sig_on_recover(void)
 {
+    CYSIGNALS_PROBE(recover, cysigs.file, cysigs.line, cysigs.sig_on_count);
+
     cysigs.block_sigint = 0;
-    PARI_SIGINT_block = 0;
     cysigs.sig_on_count = 0;
+    _sig_quota_close(0);
+    cysigs.local_depth = 0;
     cysigs.interrupt_received = 0;
-    PARI_SIGINT_pending = 0;
+    protocols_reset(1);
+    waiters_release_thread();
+    watchdog_force = 0;
+
+#if HAVE_SIGPROCMASK
+    /* Reset signal mask */
+    sigprocmask(SIG_SETMASK, &default_sigmask, NULL);
+#endif
+
+    cysigs.inside_signal_handler = 0;
+}
+
+/* Cleanup after cylongjmp() to a sig_on_local() scope with signal
+ * "sig": close that scope and restore the state of the enclosing
+ * sig_on() */
+static void _sig_on_local_recover(int sig)
+{
+    cysigs_local_t* l = &cysigs.local[cysigs.local_depth];
+    cysigs.block_sigint = l->block_sigint;
+    cysigs.sig_on_count = l->sig_on_count;
+    _sig_quota_close(cysigs.sig_on_count);
+    /* A pending interrupt (raised again by sig_unblock() or by the
+     * watchdog) was handled by this jump */
+    if (sig == cysigs.interrupt_received) cysigs.interrupt_received = 0;
+    protocols_reset(1);
+    waiters_release_thread();
+    watchdog_force = 0;
 
 #if HAVE_SIGPROCMASK
     /* Reset signal mask */
@@ -421,20 +2024,193 @@ static void _sig_off_warning(const char* file, int line)
 }
 
 
-static void setup_alt_stack(void)
+/* Alternate signal stacks. Every thread which calls sig_on() gets its
+ * own alternate stack, such that a stack overflow can be handled in
+ * any thread and not only in the thread which called
+ * init_cysignals(). The stacks are mapped with an inaccessible guard
+ * page below them. When a thread exits, its stack is returned to a
+ * small pool from which new threads take their stack. */
+#define ALT_STACK_POOL_SIZE 16
+
+typedef struct
+{
+    void* map;      /* Start of the mapping, including the guard page */
+    size_t maplen;  /* Length of the mapping */
+} cysigs_alt_stack_t;
+
+/* Size of newly allocated alternate stacks, 0 for the default */
+static size_t alt_stack_size = 0;
+
+static cysigs_alt_stack_t* alt_stack_pool[ALT_STACK_POOL_SIZE];
+static int alt_stack_pool_len = 0;
+static pthread_mutex_t alt_stack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t alt_stack_key;
+static pthread_once_t alt_stack_once = PTHREAD_ONCE_INIT;
+
+
+/* Size of a new alternate stack including the guard page, rounded up
+ * to whole pages. The default usable size is of the form
+ * MINSIGSTKSZ + constant, where the constant is chosen rather ad hoc
+ * but sufficiently large. */
+static size_t alt_stack_maplen(void)
+{
+    size_t len = alt_stack_size;
+    if (!len)
+        len = MINSIGSTKSZ + 32768 + BACKTRACELEN * sizeof(void*);
+    if (len < (size_t)MINSIGSTKSZ)
+        len = (size_t)MINSIGSTKSZ;
+    size_t ps = page_size();
+    return (len + ps - 1) / ps * ps + ps;
+}
+
+
+static void alt_stack_unmap(cysigs_alt_stack_t* st)
+{
+#if HAVE_MMAP
+    munmap(st->map, st->maplen);
+#else
+    free(st->map);
+#endif
+    free(st);
+}
+
+
+/* Take a stack from the pool or allocate a new one */
+static cysigs_alt_stack_t* alt_stack_alloc(void)
+{
+    size_t maplen = alt_stack_maplen();
+    cysigs_alt_stack_t* st = NULL;
+
+    pthread_mutex_lock(&alt_stack_lock);
+    while (alt_stack_pool_len > 0)
+    {
+        st = alt_stack_pool[--alt_stack_pool_len];
+        if (st->maplen == maplen) break;
+        /* The size was changed: discard this stack */
+        alt_stack_unmap(st);
+        st = NULL;
+    }
+    pthread_mutex_unlock(&alt_stack_lock);
+    if (st) return st;
+
+    st = malloc(sizeof(cysigs_alt_stack_t));
+    if (!st) return NULL;
+    st->maplen = maplen;
+#if HAVE_MMAP
+    st->map = mmap(NULL, maplen, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (st->map == MAP_FAILED)
+    {
+        free(st);
+        return NULL;
+    }
+    /* Stacks grow down on all supported platforms */
+    mprotect(st->map, page_size(), PROT_NONE);
+#else
+    st->map = malloc(maplen);
+    if (!st->map)
+    {
+        free(st);
+        return NULL;
+    }
+#endif
+    return st;
+}
+
+
+/* Return a stack to the pool, or unmap it if the pool is full */
+static void alt_stack_free(cysigs_alt_stack_t* st)
+{
+    pthread_mutex_lock(&alt_stack_lock);
+    if (alt_stack_pool_len < ALT_STACK_POOL_SIZE)
+    {
+        alt_stack_pool[alt_stack_pool_len++] = st;
+        st = NULL;
+    }
+    pthread_mutex_unlock(&alt_stack_lock);
+
+    if (st) alt_stack_unmap(st);
+}
+
+
+/* Destructor of alt_stack_key, called when a thread exits */
+static void alt_stack_release(void* arg)
+{
+#if HAVE_SIGALTSTACK
+    stack_t ss;
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_flags = SS_DISABLE;
+    /* This fails if we are running on the alternate stack, in that
+     * case we must not reuse it. */
+    if (sigaltstack(&ss, NULL) == -1) return;
+#endif
+    alt_stack_free(arg);
+}
+
+
+static void alt_stack_key_create(void)
+{
+    pthread_key_create(&alt_stack_key, alt_stack_release);
+}
+
+
+/* Install an alternate signal stack for the current thread. If
+ * "force" is zero, do nothing if the thread already has one. Return 0
+ * on success, -1 on failure. */
+static int install_alt_stack(int force)
 {
 #if HAVE_SIGALTSTACK
-    /* Static space for the alternate signal stack. The size should be
-     * of the form MINSIGSTKSZ + constant. The constant is chosen rather
-     * ad hoc but sufficiently large. */
-    static char alt_stack[MINSIGSTKSZ + 5120 + BACKTRACELEN * sizeof(void*)];
+    pthread_once(&alt_stack_once, alt_stack_key_create);
+
+    cysigs_alt_stack_t* st = pthread_getspecific(alt_stack_key);
+    if (st && !force) return 0;
+
+    int fresh = (st == NULL);
+    if (fresh)
+    {
+        st = alt_stack_alloc();
+        if (!st) return -1;
+    }
 
     stack_t ss;
-    ss.ss_sp = alt_stack;
-    ss.ss_size = sizeof(alt_stack);
+    ss.ss_sp = (char*)st->map + page_size();
+    ss.ss_size = st->maplen - page_size();
     ss.ss_flags = 0;
-    if (sigaltstack(&ss, NULL) == -1) {perror("sigaltstack"); exit(1);}
+    if (sigaltstack(&ss, NULL) == -1)
+    {
+        if (fresh) alt_stack_free(st);
+        return -1;
+    }
+    if (fresh) pthread_setspecific(alt_stack_key, st);
 #endif
+    return 0;
+}
+
+
+/* Called by the first sig_on() of every thread */
+static void _sig_thread_setup(void)
+{
+    install_alt_stack(0);
+}
+
+
+/* Set the usable size of alternate signal stacks allocated from now
+ * on. Threads which already have an alternate stack keep it. Return
+ * the previous size (0 means the default). */
+static size_t sig_set_alt_stack_size(size_t size)
+{
+    pthread_mutex_lock(&alt_stack_lock);
+    size_t old = alt_stack_size;
+    alt_stack_size = size;
+    pthread_mutex_unlock(&alt_stack_lock);
+    return old;
+}
+
+
+static void setup_alt_stack(void)
+{
+    if (install_alt_stack(1) == -1) {perror("sigaltstack"); exit(1);}
 #if defined(__CYGWIN__) && defined(__x86_64__)
     cygwin_setup_alt_stack();
 #endif
@@ -449,6 +2225,10 @@ static void setup_cysignals_handlers(void)
     /* Reset the cysigs structure */
     memset(&cysigs, 0, sizeof(cysigs));
 
+#if HAVE_PARI
+    sig_register_protocol(&PARI_SIGINT_block, &PARI_SIGINT_pending, NULL, NULL);
+#endif
+
 #if HAVE_SIGPROCMASK
     /* Block non-critical signals during the signal handlers and while
      * cleaning up after handling a signal */
@@ -468,17 +2248,17 @@ static void setup_cysignals_handlers(void)
 
     /* Install signal handlers */
     /* Handlers for interrupt-like signals */
-    sa.sa_handler = cysigs_interrupt_handler;
-    sa.sa_flags = 0;
+    sa.sa_sigaction = cysigs_interrupt_handler;
+    sa.sa_flags = SA_SIGINFO;
     if (sigaction(SIGHUP, &sa, NULL)) {perror("sigaction"); exit(1);}
     if (sigaction(SIGINT, &sa, NULL)) {perror("sigaction"); exit(1);}
     if (sigaction(SIGALRM, &sa, NULL)) {perror("sigaction"); exit(1);}
 
     /* Handlers for critical signals */
-    sa.sa_handler = cysigs_signal_handler;
+    sa.sa_sigaction = cysigs_signal_handler;
     /* Allow signals during signal handling, we have code to deal with
-     * this case. */
-    sa.sa_flags = SA_NODEFER | SA_ONSTACK;
+     * this case. We need SA_SIGINFO for the faulting address. */
+    sa.sa_flags = SA_NODEFER | SA_ONSTACK | SA_SIGINFO;
     if (sigaction(SIGQUIT, &sa, NULL)) {perror("sigaction"); exit(1);}
     if (sigaction(SIGILL, &sa, NULL)) {perror("sigaction"); exit(1);}
     if (sigaction(SIGABRT, &sa, NULL)) {perror("sigaction"); exit(1);}
@@ -511,6 +2291,87 @@ static void print_backtrace()
 }
 
 /* Print a backtrace using gdb */
+#if HAVE_FORK
+/* Run cysignals-CSI on the process "pid". This is called in a child
+ * process and does not return. */
+static void exec_CSI(pid_t pid, int kill_after)
+{
+    /* Redirect all output to stderr */
+    dup2(2, 1);
+
+    /* We deliberately put these variables on the stack to avoid
+     * malloc() calls, the heap might be messed up! */
+    char path[1024];
+    char pid_str[32];
+    char* argv[6];
+
+    snprintf(path, sizeof(path), "cysignals-CSI");
+    snprintf(pid_str, sizeof(pid_str), "%i", pid);
+
+    argv[0] = "cysignals-CSI";
+    argv[1] = "--no-color";
+    argv[2] = "--pid";
+    argv[3] = pid_str;
+    argv[4] = kill_after ? "--kill" : NULL;
+    argv[5] = NULL;
+    execvp(path, argv);
+    perror("Failed to execute cysignals-CSI");
+    if (kill_after) kill(pid, SIGKILL);
+    _exit(2);
+}
+#endif
+
+
+/* Asynchronous variant of print_enhanced_backtrace(), enabled by
+ * CYSIGNALS_CRASH_ASYNC: fork a snapshot of the crashed process and
+ * let cysignals-CSI analyze the snapshot in the background. The
+ * crashed process can then die immediately.
+ *
+ * The snapshot process detaches from the session, closes all file
+ * descriptors except stdin/stdout/stderr (so sockets and locks are
+ * released when the crashed process dies) and waits until
+ * cysignals-CSI kills it, but at most CSI_SNAPSHOT_TIMEOUT seconds.
+ * Only the crashing thread exists in the snapshot, which is the one
+ * whose backtrace matters. */
+#define CSI_SNAPSHOT_TIMEOUT 600
+
+static void print_enhanced_backtrace_async(void)
+{
+#if HAVE_FORK
+    pid_t pid = fork();
+
+    if (pid < 0)
+    {
+        perror("fork");
+        return;
+    }
+
+    if (pid == 0) { /* snapshot */
+#if HAVE_SETSID
+        setsid();
+#endif
+#ifdef PR_SET_PTRACER
+        prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY, 0, 0, 0);
+#endif
+        long fd, maxfd = sysconf(_SC_OPEN_MAX);
+        if (maxfd < 0 || maxfd > 65536) maxfd = 65536;
+        for (fd = 3; fd < maxfd; fd++) close(fd);
+
+        pid_t snapshot_pid = getpid();
+        pid_t csi = fork();
+        if (csi == 0) exec_CSI(snapshot_pid, 1);
+        if (csi < 0) _exit(2);
+
+        /* Wait to be killed by cysignals-CSI */
+        alarm(CSI_SNAPSHOT_TIMEOUT);
+        for (;;) pause();
+    }
+
+    fprintf(stderr, "Analyzing a snapshot of this process as process %i in the background\n", pid);
+#endif
+}
+
+
 static void print_enhanced_backtrace(void)
 {
     /* Bypass Linux Yama restrictions on ptrace() to allow debugging */
@@ -525,6 +2386,12 @@ static void print_enhanced_backtrace(void)
 
     /* Enhanced backtraces are only supported on POSIX systems */
 #if HAVE_FORK
+    if (getenv("CYSIGNALS_CRASH_ASYNC"))
+    {
+        print_enhanced_backtrace_async();
+        return;
+    }
+
     pid_t parent_pid = getpid();
     pid_t pid = fork();
 
@@ -535,28 +2402,9 @@ static void print_enhanced_backtrace(void)
         return;
     }
 
-    if (pid == 0) { /* child */
-        /* Redirect all output to stderr */
-        dup2(2, 1);
+    if (pid == 0) /* child */
+        exec_CSI(parent_pid, 0);
 
-        /* We deliberately put these variables on the stack to avoid
-         * malloc() calls, the heap might be messed up! */
-        char path[1024];
-        char pid_str[32];
-        char* argv[5];
-
-        snprintf(path, sizeof(path), "cysignals-CSI");
-        snprintf(pid_str, sizeof(pid_str), "%i", parent_pid);
-
-        argv[0] = "cysignals-CSI";
-        argv[1] = "--no-color";
-        argv[2] = "--pid";
-        argv[3] = pid_str;
-        argv[4] = NULL;
-        execvp(path, argv);
-        perror("Failed to execute cysignals-CSI");
-        exit(2);
-    }
     /* Wait for cysignals-CSI to finish */
     waitpid(pid, NULL, 0);
 #endif
@@ -568,6 +2416,8 @@ static void print_enhanced_backtrace(void)
 /* Print a message s and kill ourselves with signal sig */
 static void sigdie(int sig, const char* s)
 {
+    CYSIGNALS_PROBE(sigdie, sig, s);
+
     if (getenv("CYSIGNALS_CRASH_QUIET")) goto dienow;
 
     print_sep();
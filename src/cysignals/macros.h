@@ -48,6 +48,7 @@ will never be handled and always causes Python to exit.
 #include <setjmp.h>
 #include <signal.h>
 #include "struct_signals.h"
+#include "probes.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -94,6 +95,35 @@ extern "C" {
 
 #define _sig_on_(message) ( unlikely(_sig_on_prejmp(message, __FILE__, __LINE__)) || _sig_on_postjmp(cysetjmp(cysigs.env)) )
 
+#ifdef CYSIGNALS_THREAD_LOCAL
+/* Has _sig_thread_setup() been called for the current thread? This
+ * is a per-module cache, _sig_thread_setup() itself is idempotent. */
+static CYSIGNALS_THREAD_LOCAL int cysigs_thread_setup_done;
+
+/* pthread_self() of the current thread, cached by the first sig_on()
+ * in this thread such that sig_on() does not need to call it */
+static CYSIGNALS_THREAD_LOCAL pthread_t cysigs_thread_self;
+#endif
+
+/*
+ * Has the current job been cancelled through cysigs.cancel_flags?
+ */
+static inline int _sig_cancel_requested(void)
+{
+    volatile int* flags = cysigs.cancel_flags;
+    if (likely(flags == NULL)) return 0;
+    return flags[0] | flags[cysigs.cancel_slot];
+}
+
+/*
+ * Is the calling thread the one inside sig_on()? Only this thread may
+ * raise() an interrupt to jump back to sig_on().
+ */
+static inline int _sig_on_thread(void)
+{
+    return cysigs.sig_on_count > 0 && pthread_equal(cysigs.thread, pthread_self());
+}
+
 /*
  * Set message, return 0 if we need to cysetjmp(), return 1 otherwise.
  */
@@ -112,6 +142,7 @@ static inline int _sig_on_prejmp(const char* message, const char* file, int line
         print_backtrace();
     }
 #endif
+    CYSIGNALS_PROBE(sig_on, file, line, cysigs.sig_on_count + 1);
     if (cysigs.sig_on_count > 0)
     {
         cysigs.sig_on_count++;
@@ -119,6 +150,19 @@ static inline int _sig_on_prejmp(const char* message, const char* file, int line
     }
 
     /* At this point, cysigs.sig_on_count == 0 */
+    cysigs.file = file;
+    cysigs.line = line;
+#ifdef CYSIGNALS_THREAD_LOCAL
+    if (unlikely(!cysigs_thread_setup_done))
+    {
+        _sig_thread_setup();
+        cysigs_thread_self = pthread_self();
+        cysigs_thread_setup_done = 1;
+    }
+    cysigs.thread = cysigs_thread_self;
+#else
+    cysigs.thread = pthread_self();
+#endif
     return 0;
 }
 
@@ -152,6 +196,98 @@ static inline int _sig_on_postjmp(int jmpret)
         return 0;
     }
 
+    if (unlikely(_sig_cancel_requested()))
+    {
+        cysigs.sig_on_count = 0;
+        _sig_on_cancelled();
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Implementation of sig_on_local().  This is like _sig_on_(), except
+ * that a nested sig_on_local() pushes its own jump buffer on
+ * cysigs.local.  A critical signal (SIGSEGV, SIGFPE, ...) then jumps
+ * back to the innermost sig_on_local() instead of the outermost
+ * sig_on(), such that only the local computation is lost.  Interrupts
+ * still jump to the outermost sig_on(), unless the SIG_LOCAL_INTERRUPTS
+ * flag is given.
+ *
+ * After an exception, the scope is closed: one must not call
+ * sig_off_local() in that case.  The enclosing sig_on() scopes are
+ * unaffected.  If there is no enclosing sig_on(), this behaves exactly
+ * like sig_on().
+ */
+#define _sig_on_local_(flags, message) ( unlikely(_sig_on_local_prejmp(flags, message, __FILE__, __LINE__)) || _sig_on_local_postjmp(cysetjmp(*_sig_on_local_env())) )
+
+/*
+ * Push a scope, return 0 if we need to cysetjmp(), return 1 otherwise.
+ * The new scope is cysigs.local[cysigs.local_depth]; it is armed (by
+ * incrementing cysigs.local_depth) only in _sig_on_local_postjmp(),
+ * once cysetjmp() has filled its jump buffer.
+ */
+static inline int _sig_on_local_prejmp(int flags, const char* message, const char* file, int line)
+{
+    /* Without enclosing sig_on(), no scope can be open */
+    int d = (cysigs.sig_on_count == 0) ? 0 : cysigs.local_depth;
+
+    if (unlikely(d >= SIG_LOCAL_MAX))
+    {
+        /* Too deep: behave like a nested sig_on() */
+        CYSIGNALS_PROBE(sig_on, file, line, cysigs.sig_on_count + 1);
+        cysigs.s = message;
+        cysigs.local_depth = d + 1;
+        cysigs.sig_on_count++;
+        return 1;
+    }
+
+    cysigs_local_t* l = &cysigs.local[d];
+    l->sig_on_count = cysigs.sig_on_count;
+    l->block_sigint = cysigs.block_sigint;
+    l->flags = flags;
+    cysigs.local_depth = d;
+
+    if (cysigs.sig_on_count == 0)
+        return _sig_on_prejmp(message, file, line);
+
+    CYSIGNALS_PROBE(sig_on, file, line, cysigs.sig_on_count + 1);
+    cysigs.s = message;
+    return 0;
+}
+
+/* Jump buffer of the scope which is being pushed */
+static inline cyjmp_buf* _sig_on_local_env(void)
+{
+    cysigs_local_t* l = &cysigs.local[cysigs.local_depth];
+    if (l->sig_on_count == 0) return &cysigs.env;
+    return &l->env;
+}
+
+/* Called after cysetjmp() returned "jmpret". On a jump back,
+ * sig_jump_target() left cysigs.local_depth at the target scope. */
+static inline int _sig_on_local_postjmp(int jmpret)
+{
+    cysigs_local_t* l = &cysigs.local[cysigs.local_depth];
+    if (l->sig_on_count == 0)
+    {
+        /* This is the outermost sig_on() */
+        if (!_sig_on_postjmp(jmpret)) return 0;
+        cysigs.local_depth = 1;
+        return 1;
+    }
+
+    if (unlikely(jmpret > 0))
+    {
+        /* An exception occurred inside this scope */
+        _sig_on_local_recover(jmpret);
+        return 0;
+    }
+
+    cysigs.local_depth++;
+    cysigs.sig_on_count = l->sig_on_count + 1;
     return 1;
 }
 
@@ -169,17 +305,28 @@ static inline void _sig_off_(const char* file, int line)
         fflush(stderr);
     }
 #endif
+    CYSIGNALS_PROBE(sig_off, file, line, cysigs.sig_on_count);
     if (unlikely(cysigs.sig_on_count <= 0))
     {
         _sig_off_warning(file, line);
     }
     else
     {
+        if (unlikely(cysigs.quota_depth))
+            _sig_quota_close(cysigs.sig_on_count - 1);
         --cysigs.sig_on_count;
     }
 }
 
 
+static inline void _sig_off_local_(const char* file, int line)
+{
+    if (cysigs.local_depth > 0)
+        --cysigs.local_depth;
+    _sig_off_(file, line);
+}
+
+
 /**********************************************************************
  * USER MACROS/FUNCTIONS                                              *
  **********************************************************************/
@@ -189,9 +336,39 @@ static inline void _sig_off_(const char* file, int line)
 #define sig_str(message)   _sig_on_(message)
 #define sig_off()          _sig_off_(__FILE__, __LINE__)
 
+/* Like sig_on(), but account the memory allocated with the sig_malloc()
+ * family until the matching sig_off(): exceeding ``quota`` bytes raises
+ * MemoryError. See _sig_quota_begin(). */
+#define sig_on_quota(quota) ( _sig_on_(NULL) && _sig_quota_begin(quota) )
+
+/* Nested sig_on() which handles critical signals locally, see
+ * _sig_on_local_() */
+#define sig_on_local()          _sig_on_local_(0, NULL)
+#define sig_str_local(message)  _sig_on_local_(0, message)
+#define sig_on_local_with_interrupts()  _sig_on_local_(SIG_LOCAL_INTERRUPTS, NULL)
+#define sig_off_local()         _sig_off_local_(__FILE__, __LINE__)
+
+/* Slow path of sig_check() when cysigs.yield_requested is set */
+static inline int _sig_check_slow(void)
+{
+    if (unlikely(_sig_cancel_requested()) &&
+            (cysigs.sig_on_count == 0 || cysigs.block_sigint == 0))
+    {
+        _sig_on_cancelled();  /* Does not return inside sig_on() */
+        return 0;
+    }
+
+    _sig_yield();
+    return 1;
+}
+
 /* sig_check() should be functionally equivalent to sig_on(); sig_off();
  * but much faster.  Essentially, it checks whether we missed any
- * interrupts.
+ * interrupts.  It also runs the yield callbacks when requested by the
+ * yield timer, see _sig_yield().  A cancellation (which does not come
+ * with a signal, but is noticed by the watcher thread within about 10
+ * milliseconds) jumps back to sig_on() when inside sig_on(), except
+ * inside sig_block().
  *
  * OUTPUT: zero if an interrupt occurred, non-zero otherwise.
  */
@@ -203,6 +380,11 @@ static inline int sig_check(void)
         return 0;
     }
 
+    /* Set by the yield timer, the control channel and the watcher of
+     * the cancellation flags */
+    if (unlikely(cysigs.yield_requested))
+        return _sig_check_slow();
+
     return 1;
 }
 
@@ -264,6 +446,9 @@ static inline void sig_retry(void)
         fprintf(stderr, "sig_retry() without sig_on()\n");
         raise(SIGABRT);
     }
+    /* Close all sig_on_local() scopes, an outermost one is pushed
+     * again by _sig_on_local_postjmp() */
+    cysigs.local_depth = 0;
     cylongjmp(cysigs.env, -1);
 }
 
@@ -3,7 +3,40 @@ Memory allocation functions which are interrupt-safe
 
 The ``sig_`` variants are simple wrappers around the corresponding C
 functions. The ``check_`` variants check the return value and raise
-``MemoryError`` in case of failure.
+``MemoryError`` in case of failure. Before failing, both call the
+shrinkers registered with ``sig_register_shrinker()`` (or with
+``register_shrinker()`` from Python) and retry the allocation if
+memory was freed.
+
+The ``aligned`` variants return memory aligned to a given power of 2,
+which must be freed with ``sig_free``. The ``hugepage`` and ``numa``
+variants map page-aligned memory backed by transparent huge pages or
+placed on a given NUMA node if the system supports this. Such memory
+must be freed with ``sig_mapped_free`` with the allocated size in
+bytes.
+
+The ``sig_mp_`` functions can be installed as custom memory functions
+of libraries like GMP, see below.
+
+The ``guarded`` variants map the memory between two inaccessible guard
+pages. An access beyond the end of such a buffer inside ``sig_on()``
+raises a ``SignalError`` naming the buffer, instead of silently
+corrupting memory. This memory must be freed with ``sig_guarded_free``.
+
+The ``lazy`` variants reserve memory whose pages are only computed on
+first access, by a fill function called from the ``SIGSEGV`` handler.
+This memory is read-only and must be freed with ``sig_lazy_free``.
+
+``sig_mmap_file`` maps a file for zero-copy access. If reading the
+mapped file fails inside ``sig_on()`` (for example because the file
+was truncated), ``MappedFileError`` is raised, an ``OSError`` giving
+the file name and the offset. The failing page stays inaccessible.
+Such a mapping must be unmapped with ``sig_munmap_file``.
+
+Inside ``sig_on_quota(quota)``, the ``sig_``, ``check_`` and
+``aligned`` variants account the memory they allocate and free. An
+allocation which would make the net allocated size exceed ``quota``
+bytes raises ``MemoryError`` and jumps back to ``sig_on_quota()``.
 """
 
 #*****************************************************************************
@@ -27,39 +60,162 @@ functions. The ``check_`` variants check the return value and raise
 
 cimport cython
 from libc.stdlib cimport malloc, calloc, realloc, free
-from .signals cimport sig_block, sig_unblock
+from libc.stdlib cimport abort
+from posix.stdlib cimport posix_memalign
+from cpython.exc cimport (PyErr_SetNone, PyErr_SetString,
+        PyErr_SetFromErrnoWithFilenameObject)
+from .signals cimport cysigs, sig_error
+from .signals cimport (_sig_quota_size, _sig_quota_exceeds,
+        _sig_quota_update)
+from .signals cimport (sig_block, sig_unblock, sig_lazy_fill_func,
+        sig_shrink_memory,
+        _sig_hugepage_malloc, _sig_numa_malloc, _sig_mapped_free,
+        _sig_guarded_malloc, _sig_guarded_free,
+        _sig_lazy_malloc, _sig_lazy_free,
+        _sig_mmap_file, _sig_munmap_file)
 
 cdef extern from *:
     int unlikely(int) nogil  # Defined by Cython
 
 
+cdef inline void sig_quota_exceeded() nogil:
+    with gil:
+        PyErr_SetString(MemoryError, "memory quota of sig_on_quota() exceeded")
+    sig_error()
+
+
 cdef inline void* sig_malloc "sig_malloc"(size_t n) nogil:
+    if unlikely(cysigs.quota_depth) and _sig_quota_exceeds(n, 0):
+        sig_quota_exceeded()
     sig_block()
     cdef void* ret = malloc(n)
     sig_unblock()
+    cdef int cursor = 0
+    while unlikely(ret == NULL) and n and sig_shrink_memory(n, &cursor):
+        sig_block()
+        ret = malloc(n)
+        sig_unblock()
+    if unlikely(cysigs.quota_depth):
+        _sig_quota_update(_sig_quota_size(ret), 0)
     return ret
 
 
 cdef inline void* sig_realloc "sig_realloc"(void* ptr, size_t size) nogil:
-    sig_block()
-    cdef void* ret = realloc(ptr, size)
-    sig_unblock()
+    cdef size_t old = 0
+    if unlikely(cysigs.quota_depth):
+        old = _sig_quota_size(ptr)
+        if _sig_quota_exceeds(size, old):
+            sig_quota_exceeded()
+    cdef void* ret
+    cdef int cursor = 0
+    while True:
+        sig_block()
+        ret = realloc(ptr, size)
+        sig_unblock()
+        if ret != NULL or not size or not sig_shrink_memory(size, &cursor):
+            break
+    if unlikely(cysigs.quota_depth) and (ret != NULL or not size):
+        _sig_quota_update(_sig_quota_size(ret), old)
     return ret
 
 
 cdef inline void* sig_calloc "sig_calloc"(size_t nmemb, size_t size) nogil:
+    # On overflow, n is <size_t>(-1) which exceeds any quota and which
+    # cannot be allocated, no matter how much memory is freed
+    cdef size_t n = mul_overflowcheck(nmemb, size) if nmemb else 0
+    if unlikely(cysigs.quota_depth) and _sig_quota_exceeds(n, 0):
+        sig_quota_exceeded()
     sig_block()
     cdef void* ret = calloc(nmemb, size)
     sig_unblock()
+    cdef int cursor = 0
+    while unlikely(ret == NULL) and n and n != <size_t>(-1) and sig_shrink_memory(n, &cursor):
+        sig_block()
+        ret = calloc(nmemb, size)
+        sig_unblock()
+    if unlikely(cysigs.quota_depth):
+        _sig_quota_update(_sig_quota_size(ret), 0)
     return ret
 
 
 cdef inline void sig_free "sig_free"(void* ptr) nogil:
+    if unlikely(cysigs.quota_depth):
+        _sig_quota_update(0, _sig_quota_size(ptr))
     sig_block()
     free(ptr)
     sig_unblock()
 
 
+cdef inline void sig_mp_nomem() nogil:
+    if cysigs.sig_on_count > 0:
+        with gil:
+            PyErr_SetNone(MemoryError)
+        sig_error()
+    abort()
+
+
+cdef inline void* sig_mp_alloc "sig_mp_alloc"(size_t n) nogil:
+    cdef void* ret = sig_malloc(n)
+    if unlikely(ret == NULL):
+        sig_mp_nomem()
+    return ret
+
+
+cdef inline void* sig_mp_realloc "sig_mp_realloc"(void* ptr, size_t oldsize, size_t newsize) nogil:
+    cdef void* ret = sig_realloc(ptr, newsize)
+    if unlikely(ret == NULL):
+        sig_mp_nomem()
+    return ret
+
+
+cdef inline void sig_mp_free "sig_mp_free"(void* ptr, size_t size) nogil:
+    sig_free(ptr)
+
+cdef inline void* sig_aligned_malloc "sig_aligned_malloc"(size_t alignment, size_t n) nogil:
+    if unlikely(cysigs.quota_depth) and _sig_quota_exceeds(n, 0):
+        sig_quota_exceeded()
+    cdef void* ret
+    cdef int cursor = 0
+    while True:
+        sig_block()
+        if posix_memalign(&ret, alignment, n):
+            ret = NULL
+        sig_unblock()
+        if ret != NULL or not n or not sig_shrink_memory(n, &cursor):
+            break
+    if unlikely(cysigs.quota_depth):
+        _sig_quota_update(_sig_quota_size(ret), 0)
+    return ret
+
+
+cdef inline void* sig_hugepage_malloc "sig_hugepage_malloc"(size_t n) nogil:
+    cdef void* ret
+    cdef int cursor = 0
+    while True:
+        sig_block()
+        ret = _sig_hugepage_malloc(n)
+        sig_unblock()
+        if ret != NULL or not n or not sig_shrink_memory(n, &cursor):
+            return ret
+
+
+cdef inline void* sig_numa_malloc "sig_numa_malloc"(size_t n, int node) nogil:
+    cdef void* ret
+    cdef int cursor = 0
+    while True:
+        sig_block()
+        ret = _sig_numa_malloc(n, node)
+        sig_unblock()
+        if ret != NULL or not n or not sig_shrink_memory(n, &cursor):
+            return ret
+
+
+cdef inline void sig_mapped_free "sig_mapped_free"(void* ptr, size_t n) nogil:
+    sig_block()
+    _sig_mapped_free(ptr, n)
+    sig_unblock()
+
+
 @cython.cdivision(True)
 cdef inline size_t mul_overflowcheck(size_t a, size_t b) nogil:
     """
@@ -143,3 +299,162 @@ cdef inline void* check_calloc(size_t nmemb, size_t size) except? NULL:
     if unlikely(ret == NULL):
         raise MemoryError("failed to allocate %s * %s bytes" % (nmemb, size))
     return ret
+
+
+cdef inline void* check_aligned_alloc(size_t alignment, size_t nmemb, size_t size) except? NULL:
+    """
+    Allocate memory for ``nmemb`` elements of size ``size``, aligned
+    to ``alignment`` bytes which must be a power of 2. Free the memory
+    with ``sig_free``.
+    """
+    if alignment & (alignment - 1):
+        raise ValueError("alignment must be a power of 2, got %s" % alignment)
+    if alignment < sizeof(void*):
+        alignment = sizeof(void*)
+    if nmemb == 0:
+        return NULL
+    cdef size_t n = mul_overflowcheck(nmemb, size)
+    cdef void* ret = sig_aligned_malloc(alignment, n)
+    if unlikely(ret == NULL):
+        raise MemoryError("failed to allocate %s * %s bytes" % (nmemb, size))
+    return ret
+
+
+cdef inline void* check_hugepage_alloc(size_t nmemb, size_t size) except? NULL:
+    """
+    Allocate memory for ``nmemb`` elements of size ``size``, backed by
+    transparent huge pages if possible. The memory is page-aligned and
+    zeroed. Free the memory with ``sig_mapped_free(ptr, nmemb * size)``.
+    """
+    if nmemb == 0:
+        return NULL
+    cdef size_t n = mul_overflowcheck(nmemb, size)
+    cdef void* ret = sig_hugepage_malloc(n)
+    if unlikely(ret == NULL):
+        raise MemoryError("failed to allocate %s * %s bytes" % (nmemb, size))
+    return ret
+
+
+cdef inline void* check_numa_alloc(size_t nmemb, size_t size, int node) except? NULL:
+    """
+    Allocate memory for ``nmemb`` elements of size ``size``, placed on
+    NUMA node ``node`` if possible. The memory is page-aligned and
+    zeroed. Free the memory with ``sig_mapped_free(ptr, nmemb * size)``.
+    """
+    if node < 0:
+        raise ValueError("NUMA node must be >= 0, got %s" % node)
+    if nmemb == 0:
+        return NULL
+    cdef size_t n = mul_overflowcheck(nmemb, size)
+    cdef void* ret = sig_numa_malloc(n, node)
+    if unlikely(ret == NULL):
+        raise MemoryError("failed to allocate %s * %s bytes" % (nmemb, size))
+    return ret
+
+
+cdef inline void* sig_guarded_malloc "sig_guarded_malloc"(size_t n, const char* name) nogil:
+    sig_block()
+    cdef void* ret = _sig_guarded_malloc(n, name)
+    sig_unblock()
+    return ret
+
+
+cdef inline void sig_guarded_free "sig_guarded_free"(void* ptr) nogil:
+    sig_block()
+    _sig_guarded_free(ptr)
+    sig_unblock()
+
+
+cdef inline void* check_guarded_malloc(size_t n, const char* name) except? NULL:
+    """
+    Allocate ``n`` bytes of memory followed by a guard page. The
+    ``name`` is used in the exception raised when the buffer is
+    overflowed.
+    """
+    if n == 0:
+        return NULL
+    cdef void* ret = sig_guarded_malloc(n, name)
+    if unlikely(ret == NULL):
+        raise MemoryError("failed to allocate %s bytes" % n)
+    return ret
+
+
+cdef inline void* check_guarded_allocarray(size_t nmemb, size_t size, const char* name) except? NULL:
+    """
+    Allocate memory for ``nmemb`` elements of size ``size`` followed
+    by a guard page. The ``name`` is used in the exception raised when
+    the array is overflowed.
+
+    The array ends exactly at the guard page, so the elements are
+    aligned to ``size`` if that is a power of 2 not exceeding the page
+    size.
+    """
+    if nmemb == 0:
+        return NULL
+    cdef size_t n = mul_overflowcheck(nmemb, size)
+    cdef void* ret = sig_guarded_malloc(n, name)
+    if unlikely(ret == NULL):
+        raise MemoryError("failed to allocate %s * %s bytes" % (nmemb, size))
+    return ret
+
+
+cdef inline void* sig_lazy_malloc "sig_lazy_malloc"(size_t n, sig_lazy_fill_func fill, void* arg, const char* name) nogil:
+    sig_block()
+    cdef void* ret = _sig_lazy_malloc(n, fill, arg, name)
+    sig_unblock()
+    return ret
+
+
+cdef inline void sig_lazy_free "sig_lazy_free"(void* ptr) nogil:
+    sig_block()
+    _sig_lazy_free(ptr)
+    sig_unblock()
+
+
+cdef inline void* check_lazy_malloc(size_t n, sig_lazy_fill_func fill, void* arg, const char* name) except? NULL:
+    """
+    Reserve ``n`` bytes of read-only memory whose contents are computed
+    page by page on first access.
+
+    When a page is first accessed, ``fill(page, offset, len, arg)`` is
+    called to store in ``page`` the ``len`` bytes of the array starting
+    at byte ``offset``. Since ``fill`` is called from a signal handler,
+    it must not call ``malloc()`` or any Python functions. It may be
+    called more than once for the same page by concurrent threads, so
+    it should be deterministic.
+    """
+    if n == 0:
+        return NULL
+    cdef void* ret = sig_lazy_malloc(n, fill, arg, name)
+    if unlikely(ret == NULL):
+        raise MemoryError("failed to allocate %s bytes" % n)
+    return ret
+
+
+cdef inline void* sig_mmap_file "sig_mmap_file"(int fd, long long offset, size_t length, bint writable, const char* name) nogil:
+    sig_block()
+    cdef void* ret = _sig_mmap_file(fd, offset, length, writable, name)
+    sig_unblock()
+    return ret
+
+
+cdef inline int sig_munmap_file "sig_munmap_file"(void* ptr) nogil:
+    sig_block()
+    cdef int ret = _sig_munmap_file(ptr)
+    sig_unblock()
+    return ret
+
+
+cdef inline void* check_mmap_file(int fd, long long offset, size_t length, bint writable, name) except NULL:
+    """
+    Map ``length`` bytes (or the rest of the file if ``length`` is 0)
+    of the open file ``fd`` starting at ``offset``, which need not be
+    a multiple of the page size. The mapping is shared with the file.
+    The ``name`` (a ``str`` or ``bytes``, typically the file name) is
+    reported by ``MappedFileError``. Raise ``OSError`` on failure.
+    """
+    cdef bytes bname = name if isinstance(name, bytes) else str(name).encode("utf-8", "surrogateescape")
+    cdef void* ret = sig_mmap_file(fd, offset, length, writable, bname)
+    if unlikely(ret == NULL):
+        PyErr_SetFromErrnoWithFilenameObject(OSError, name)
+    return ret
@@ -4,4 +4,11 @@ from cysignals.signals cimport *
 from cysignals.memory cimport (
         sig_malloc, sig_realloc, sig_calloc, sig_free,
         check_allocarray, check_reallocarray,
-        check_malloc, check_realloc, check_calloc)
+        check_malloc, check_realloc, check_calloc,
+        sig_aligned_malloc, sig_hugepage_malloc, sig_numa_malloc,
+        sig_mapped_free,
+        sig_mp_alloc, sig_mp_realloc, sig_mp_free,
+        check_aligned_alloc, check_hugepage_alloc, check_numa_alloc,
+        sig_guarded_malloc, sig_guarded_free,
+        check_guarded_malloc, check_guarded_allocarray,
+        sig_lazy_malloc, sig_lazy_free, check_lazy_malloc)
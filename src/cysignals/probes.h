@@ -0,0 +1,76 @@
+/*
+Static tracepoints (USDT probes) for perf, bpftrace and SystemTap.
+
+If cysignals was configured with <sys/sdt.h> available, the following
+probes of provider "cysignals" are compiled in:
+
+  sig_on(file, line, count)     entering sig_on(), count is the new
+                                nesting level (1 for the outermost)
+  sig_off(file, line, count)    leaving sig_off(), count is the nesting
+                                level being left
+  interrupt(sig, count, block)  an interrupt-like signal was received,
+                                count and block are cysigs.sig_on_count
+                                and cysigs.block_sigint
+  signal(sig, count, message)   a critical signal was received
+  raise(sig, message)           raising the exception for a signal
+  recover(file, line, count)    jumped back to the sig_on() at file:line
+  sigdie(sig, message)          dying from an unhandled signal
+
+The sig_on and sig_off probes are inlined in every module using
+sig_on(); the others are in cysignals.signals. Every probe is guarded
+by a semaphore, so it costs only a test of a memory word when no
+tracer is attached. See src/scripts/bpftrace for example scripts.
+*/
+
+/*****************************************************************************
+ *  cysignals is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU Lesser General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  cysignals is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef CYSIGNALS_PROBES_H
+#define CYSIGNALS_PROBES_H
+
+#include "cysignals_config.h"
+
+#if CYSIGNALS_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+/* The semaphores are incremented by the tracer when attaching to the
+ * corresponding probe. Each module has its own copy. */
+#define _CYSIGNALS_SEMAPHORE(name) \
+    static volatile unsigned short cysignals_##name##_semaphore \
+        __attribute__((unused, section(".probes")))
+
+_CYSIGNALS_SEMAPHORE(sig_on);
+_CYSIGNALS_SEMAPHORE(sig_off);
+_CYSIGNALS_SEMAPHORE(interrupt);
+_CYSIGNALS_SEMAPHORE(signal);
+_CYSIGNALS_SEMAPHORE(raise);
+_CYSIGNALS_SEMAPHORE(recover);
+_CYSIGNALS_SEMAPHORE(sigdie);
+
+#define CYSIGNALS_PROBE(name, ...) do { \
+    if (__builtin_expect(cysignals_##name##_semaphore, 0)) \
+        STAP_PROBEV(cysignals, name, __VA_ARGS__); \
+    } while (0)
+
+#else
+
+#define CYSIGNALS_PROBE(name, ...) do {} while (0)
+
+#endif
+
+#endif  /* ifndef CYSIGNALS_PROBES_H */
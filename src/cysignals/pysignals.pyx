@@ -166,7 +166,7 @@ def getossignal(int sig):
         >>> from cysignals.pysignals import getossignal
         >>> import signal
         >>> getossignal(signal.SIGINT)
-        <SigAction with sa_handler=0x...>
+        <SigAction with sa_sigaction=0x...>
         >>> getossignal(signal.SIGUSR1)
         <SigAction with sa_handler=SIG_DFL>
         >>> def handler(*args): pass
@@ -0,0 +1,340 @@
+/*
+Interruptible file and socket I/O for code running without the GIL.
+
+These functions transfer data between file descriptors and buffers
+provided by the caller (or directly between file descriptors with
+sendfile() and splice()). They loop until everything has been
+transferred or until end-of-file, restarting after EINTR and partial
+transfers.
+
+Interrupts are handled between system calls: the number of bytes
+transferred so far is always stored in *done, also when the transfer
+is interrupted. Inside sig_on(), an interrupt jumps back to sig_on()
+after *done was updated. Outside sig_on(), the exception is raised and
+0 is returned. Other errors raise OSError in the same way.
+
+Non-blocking file descriptors (O_NONBLOCK) are waited for with ppoll(),
+which atomically unblocks the interrupt signals, so interrupts are
+handled immediately. A system call which blocks can only be interrupted
+if the signal is delivered to the calling thread.
+
+These functions return 1 on success and 0 if an exception was raised.
+They are only available on Linux; elsewhere they raise OSError with
+errno ENOSYS.
+*/
+
+/*****************************************************************************
+ *  cysignals is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU Lesser General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  cysignals is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef CYSIGNALS_SIGIO_H
+#define CYSIGNALS_SIGIO_H
+
+#include <Python.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#if defined(__linux__)
+#define CYSIGNALS_HAVE_SIGIO 1
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
+#include "macros.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Maximum number of iovecs passed to one system call */
+#define SIG_IO_IOV_MAX 64
+
+
+/* Raise OSError from errno. Inside sig_on(), jump back to sig_on().
+ * Otherwise, return 0. This must be called inside sig_block(). */
+static inline int _sig_io_error(void)
+{
+    PyGILState_STATE gilstate = PyGILState_Ensure();
+    PyErr_SetFromErrno(PyExc_OSError);
+    PyGILState_Release(gilstate);
+    --cysigs.block_sigint;
+    if (cysigs.sig_on_count > 0) sig_error();
+    return 0;
+}
+
+
+/* Is an interrupt pending which should stop the transfer? The caller
+ * is inside sig_block(); interrupts inside an outer sig_block() are
+ * left to the outer sig_unblock(). */
+static inline int _sig_io_interrupt_pending(void)
+{
+    return unlikely(cysigs.interrupt_received) &&
+        (cysigs.sig_on_count == 0 || cysigs.block_sigint == 1);
+}
+
+
+/* Handle a pending interrupt: unblock, which jumps back to sig_on()
+ * if we are inside sig_on(), or raise the exception like sig_check().
+ * Return 0 if an exception was raised. Otherwise (if another thread
+ * dealt with the interrupt), block again and return 1. */
+static inline int _sig_io_interrupted(void)
+{
+    sig_unblock();
+    if (!sig_check()) return 0;
+    sig_block();
+    return 1;
+}
+
+
+/* Number of bytes described by an iovec array */
+static inline size_t _sig_iov_total(const struct iovec* iov, int iovcnt)
+{
+    size_t total = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    return total;
+}
+
+
+/* Store in "win" the part of the iovec array after the first "skip"
+ * bytes, with at most SIG_IO_IOV_MAX entries. Return the number of
+ * entries. */
+static inline int _sig_iov_window(const struct iovec* iov, int iovcnt, size_t skip, struct iovec* win)
+{
+    int i = 0, n = 0;
+    while (i < iovcnt && skip >= iov[i].iov_len)
+        skip -= iov[i++].iov_len;
+    for (; i < iovcnt && n < SIG_IO_IOV_MAX; i++)
+    {
+        win[n].iov_base = (char*)iov[i].iov_base + skip;
+        win[n].iov_len = iov[i].iov_len - skip;
+        skip = 0;
+        if (win[n].iov_len) n++;
+    }
+    return n;
+}
+
+
+/* Wait until "fd" is ready for "events" (POLLIN or POLLOUT). Return 1
+ * when ready, 0 if an exception was raised. This must be called inside
+ * sig_block(). */
+static inline int _sig_io_wait(int fd, short events)
+{
+#if CYSIGNALS_HAVE_SIGIO
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+
+    sigset_t interrupts, oldmask;
+    sigemptyset(&interrupts);
+    sigaddset(&interrupts, SIGHUP);
+    sigaddset(&interrupts, SIGINT);
+    sigaddset(&interrupts, SIGALRM);
+
+    for (;;)
+    {
+        /* Block the interrupts between checking for them and ppoll() */
+        pthread_sigmask(SIG_BLOCK, &interrupts, &oldmask);
+        int pending = _sig_io_interrupt_pending();
+        int r = 0;
+        if (!pending) r = ppoll(&pfd, 1, NULL, &oldmask);
+        int err = errno;
+        pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+        if (pending || _sig_io_interrupt_pending())
+        {
+            if (!_sig_io_interrupted()) return 0;
+            continue;
+        }
+        if (r > 0) return 1;
+        if (r < 0 && err != EINTR)
+        {
+            errno = err;
+            return _sig_io_error();
+        }
+    }
+#else
+    errno = ENOSYS;
+    return _sig_io_error();
+#endif
+}
+
+
+/* Common part of the loops: handle the result "r" of a system call.
+ * Return 1 to continue, 0 to return 0 (an exception was raised) and
+ * -1 to stop at end-of-file. */
+static inline int _sig_io_step(ssize_t r, size_t* done, int fd, short events)
+{
+    if (r > 0) {*done += (size_t)r; return 1;}
+    if (r == 0) return -1;
+    if (errno == EINTR) return 1;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return _sig_io_wait(fd, events);
+    return _sig_io_error();
+}
+
+
+/* Finish a transfer: unblock interrupts (which may jump back to
+ * sig_on() after a successful transfer) */
+static inline int _sig_io_done(void)
+{
+    sig_unblock();
+    return 1;
+}
+
+
+#define _SIG_IO_LOOP(fd, events, total, SYSCALL)            \
+    *done = 0;                                              \
+    sig_block();                                            \
+    while (*done < (total))                                 \
+    {                                                       \
+        if (_sig_io_interrupt_pending())                    \
+        {                                                   \
+            if (!_sig_io_interrupted()) return 0;           \
+            continue;                                       \
+        }                                                   \
+        ssize_t r = SYSCALL;                                \
+        int s = _sig_io_step(r, done, fd, events);          \
+        if (s == 0) return 0;                               \
+        if (s < 0) break;                                   \
+    }                                                       \
+    return _sig_io_done();
+
+
+/* Read into the buffers "iov" from "fd" at "offset" */
+static inline int sig_preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset, size_t* done)
+{
+#if CYSIGNALS_HAVE_SIGIO
+    struct iovec win[SIG_IO_IOV_MAX];
+    size_t total = _sig_iov_total(iov, iovcnt);
+    _SIG_IO_LOOP(fd, POLLIN, total,
+        preadv(fd, win, _sig_iov_window(iov, iovcnt, *done, win), offset + (off_t)*done))
+#else
+    *done = 0;
+    errno = ENOSYS;
+    sig_block();
+    return _sig_io_error();
+#endif
+}
+
+
+/* Write the buffers "iov" to "fd" at "offset" */
+static inline int sig_pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset, size_t* done)
+{
+#if CYSIGNALS_HAVE_SIGIO
+    struct iovec win[SIG_IO_IOV_MAX];
+    size_t total = _sig_iov_total(iov, iovcnt);
+    _SIG_IO_LOOP(fd, POLLOUT, total,
+        pwritev(fd, win, _sig_iov_window(iov, iovcnt, *done, win), offset + (off_t)*done))
+#else
+    *done = 0;
+    errno = ENOSYS;
+    sig_block();
+    return _sig_io_error();
+#endif
+}
+
+
+/* Receive from a stream socket into the buffers msg->msg_iov until
+ * they are full or until the connection is closed. Control messages
+ * are only received by the first recvmsg() call. */
+static inline int sig_recvmsg(int fd, struct msghdr* msg, int flags, size_t* done)
+{
+#if CYSIGNALS_HAVE_SIGIO
+    struct iovec win[SIG_IO_IOV_MAX];
+    struct msghdr m = *msg;
+    size_t total = _sig_iov_total(msg->msg_iov, (int)msg->msg_iovlen);
+    m.msg_iov = win;
+    _SIG_IO_LOOP(fd, POLLIN, total,
+        (m.msg_iovlen = _sig_iov_window(msg->msg_iov, (int)msg->msg_iovlen, *done, win),
+         m.msg_control = (*done) ? NULL : msg->msg_control,
+         m.msg_controllen = (*done) ? 0 : msg->msg_controllen,
+         recvmsg(fd, &m, flags)))
+#else
+    *done = 0;
+    errno = ENOSYS;
+    sig_block();
+    return _sig_io_error();
+#endif
+}
+
+
+/* Copy "count" bytes from "in_fd" (at *offset if offset is not NULL)
+ * to "out_fd" */
+static inline int sig_sendfile(int out_fd, int in_fd, off_t* offset, size_t count, size_t* done)
+{
+#if CYSIGNALS_HAVE_SIGIO
+    _SIG_IO_LOOP(out_fd, POLLOUT, count,
+        sendfile(out_fd, in_fd, offset, count - *done))
+#else
+    *done = 0;
+    errno = ENOSYS;
+    sig_block();
+    return _sig_io_error();
+#endif
+}
+
+
+/* Move "len" bytes from "fd_in" to "fd_out", one of which must be a
+ * pipe, see splice(2). The offsets are updated like for splice().
+ * Waiting is done for "fd_in" if the transfer would block; use
+ * SPLICE_F_NONBLOCK in "flags" for non-blocking transfers on blocking
+ * pipes. */
+static inline ssize_t _sig_splice(int fd_in, off_t* off_in, int fd_out, off_t* off_out,
+                                  size_t len, unsigned int flags)
+{
+#if CYSIGNALS_HAVE_SIGIO
+    loff_t in = off_in ? *off_in : 0, out = off_out ? *off_out : 0;
+    ssize_t r = splice(fd_in, off_in ? &in : NULL, fd_out, off_out ? &out : NULL, len, flags);
+    if (off_in) *off_in = (off_t)in;
+    if (off_out) *off_out = (off_t)out;
+    return r;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static inline int sig_splice(int fd_in, off_t* off_in, int fd_out, off_t* off_out,
+                             size_t len, unsigned int flags, size_t* done)
+{
+#if CYSIGNALS_HAVE_SIGIO
+    _SIG_IO_LOOP(fd_in, POLLIN, len,
+        _sig_splice(fd_in, off_in, fd_out, off_out, len - *done, flags))
+#else
+    *done = 0;
+    errno = ENOSYS;
+    sig_block();
+    return _sig_io_error();
+#endif
+}
+
+
+/* Wait until "fd" is ready for "events" (POLLIN or POLLOUT) */
+static inline int sig_wait_fd(int fd, short events)
+{
+    sig_block();
+    if (!_sig_io_wait(fd, events)) return 0;
+    return _sig_io_done();
+}
+
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* ifndef CYSIGNALS_SIGIO_H */
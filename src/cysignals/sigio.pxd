@@ -0,0 +1,62 @@
+# cython: preliminary_late_includes_cy28=True
+"""
+Interruptible file and socket I/O for code running without the GIL
+
+These functions loop over ``preadv``, ``pwritev``, ``recvmsg``,
+``sendfile`` and ``splice`` until the whole transfer is done or until
+end-of-file, restarting after ``EINTR`` and short transfers. Waiting
+for non-blocking file descriptors uses ``ppoll``, which reacts to
+interrupts immediately.
+
+The number of bytes transferred is always stored in ``done``, also
+when the transfer is interrupted: inside ``sig_on()``, an interrupt
+jumps back to ``sig_on()``. Outside ``sig_on()``, the exception is
+raised like ``sig_check()``. Other errors raise ``OSError``. The
+functions are only implemented on Linux. See ``sigio.h`` for details.
+"""
+
+#*****************************************************************************
+#  cysignals is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Lesser General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  cysignals is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public License
+#  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+#
+#*****************************************************************************
+
+from posix.types cimport off_t
+from posix.uio cimport iovec
+from .signals cimport cysigs
+
+
+cdef extern from "<poll.h>":
+    enum:
+        POLLIN
+        POLLOUT
+
+
+cdef extern from "<sys/socket.h>":
+    cdef struct msghdr:
+        void* msg_name
+        iovec* msg_iov
+        size_t msg_iovlen
+        void* msg_control
+        size_t msg_controllen
+        int msg_flags
+
+
+cdef extern from "sigio.h" nogil:
+    int sig_preadv(int fd, const iovec* iov, int iovcnt, off_t offset, size_t* done) except 0
+    int sig_pwritev(int fd, const iovec* iov, int iovcnt, off_t offset, size_t* done) except 0
+    int sig_recvmsg(int fd, msghdr* msg, int flags, size_t* done) except 0
+    int sig_sendfile(int out_fd, int in_fd, off_t* offset, size_t count, size_t* done) except 0
+    int sig_splice(int fd_in, off_t* off_in, int fd_out, off_t* off_out,
+                   size_t len, unsigned int flags, size_t* done) except 0
+    int sig_wait_fd(int fd, short events) except 0
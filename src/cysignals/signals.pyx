@@ -26,11 +26,15 @@ See ``tests.pyx`` for extensive tests.
 from __future__ import absolute_import
 
 from libc.signal cimport *
+from libc.errno cimport EIO
 from libc.stdio cimport freopen, stdin
 from cpython.ref cimport Py_XINCREF, Py_XDECREF
 from cpython.exc cimport (PyErr_Occurred, PyErr_NormalizeException,
-        PyErr_Fetch, PyErr_Restore)
+        PyErr_Fetch, PyErr_Restore, PyErr_SetObject)
 from cpython.version cimport PY_MAJOR_VERSION
+from cpython.buffer cimport PyObject_GetBuffer, PyBuffer_Release, PyBUF_WRITABLE
+from posix.mman cimport (mmap, munmap, PROT_READ, PROT_WRITE,
+        MAP_SHARED, MAP_ANONYMOUS, MAP_FAILED)
 
 cimport cython
 import sys
@@ -44,14 +48,58 @@ cdef extern from "implementation.c":
     void setup_cysignals_handlers() nogil
     void print_backtrace() nogil
     void _sig_on_interrupt_received() nogil
+    void _sig_on_cancelled() nogil
     void _sig_on_recover() nogil
+    void _sig_on_local_recover(int) nogil
+    void _sig_yield() nogil
+    int sig_set_yield_interval(double) nogil
+    int sig_set_cancel_watcher(int) nogil
     void _sig_off_warning(const char*, int) nogil
+    void _sig_thread_setup() nogil
+    size_t sig_set_alt_stack_size(size_t) nogil
+    int sig_control_install(int) nogil
+    int sig_control_uninstall(int) nogil
+    int sig_control_pop(int*, int*, long*, long*) nogil
+    unsigned long sig_control_dropped() nogil
+    int sig_control_send(long, int, int) nogil
+    int sig_watchdog_start(double, double, int) nogil
+    void sig_watchdog_stop() nogil
+    int sig_exception_reusable(PyObject*)
+    int WATCHDOG_LOG, WATCHDOG_INTERRUPT, WATCHDOG_TERMINATE
+    int SIG_CANCEL, SIG_MAPPED_FILE
+    char* mapped_fault_name
+    long long mapped_fault_offset
+    void* _sig_guarded_malloc(size_t, const char*) nogil
+    void _sig_guarded_free(void*) nogil
+    void* _sig_lazy_malloc(size_t, sig_lazy_fill_func, void*, const char*) nogil
+    void _sig_lazy_free(void*) nogil
+    void* _sig_mmap_file(int, long long, size_t, int, const char*) nogil
+    int _sig_munmap_file(void*) nogil
+    void* _sig_hugepage_malloc(size_t) nogil
+    void* _sig_numa_malloc(size_t, int) nogil
+    void _sig_mapped_free(void*, size_t) nogil
+    int sig_register_protocol(int*, int*, sig_recover_func, void*) nogil
+    int sig_unregister_protocol(int*) nogil
+    int sig_register_shrinker(sig_shrinker_func, void*, int) nogil
+    int sig_unregister_shrinker(sig_shrinker_func, void*) nogil
+    int sig_shrink_memory(size_t, int*) nogil
+    int _sig_quota_begin(size_t) nogil
+    void _sig_quota_close(int) nogil
+    size_t _sig_quota_size(void*) nogil
+    int _sig_quota_exceeds(size_t, size_t) nogil
+    void _sig_quota_update(size_t, size_t) nogil
+    long long sig_quota_current() nogil
+    long long sig_quota_peak() nogil
+    int _sig_futex_wait(int*, int) nogil
+    void _sig_futex_wake(int*, int) nogil
+    void _sig_raise_pending() nogil
 
     # Python library functions for raising exceptions without "except"
     # clause.
     void PyErr_SetNone(object type)
     void PyErr_SetString(object type, char *message)
     void PyErr_Format(object exception, char *format, ...)
+    object PyErr_SetFromErrno(object type)
 
     # PARI version string; NULL if compiled without PARI support
     const char* paricfg_version
@@ -103,6 +151,20 @@ class AlarmInterrupt(KeyboardInterrupt):
     pass
 
 
+class CancelInterrupt(KeyboardInterrupt):
+    """
+    Exception class for jobs cancelled through :class:`CancelFlags`.
+
+    EXAMPLES::
+
+        >>> from cysignals import CancelInterrupt
+        >>> issubclass(CancelInterrupt, KeyboardInterrupt)
+        True
+
+    """
+    pass
+
+
 class SignalError(BaseException):
     """
     Exception class for critical signals such as ``SIGSEGV``. Inherits
@@ -119,6 +181,31 @@ class SignalError(BaseException):
     pass
 
 
+class MappedFileError(OSError):
+    """
+    Exception class for a ``SIGBUS`` inside ``sig_on()`` when accessing
+    a file mapped with ``sig_mmap_file()``, typically because the file
+    was truncated or because of an I/O error. The ``filename`` and
+    ``offset`` attributes give the file and the offset in the file of
+    the failed access. The ``errno`` is ``EIO``.
+
+    EXAMPLES::
+
+        >>> from cysignals import MappedFileError
+        >>> issubclass(MappedFileError, OSError)
+        True
+
+    """
+    offset = None
+
+
+# Exception instances for SIGINT and SIGALRM, raised again by
+# sig_raise_exception() when they are no longer referenced. This avoids
+# creating and normalizing a new exception for every interrupt.
+cdef PyObject* cached_interrupts[2]
+cdef bint cache_interrupts = True
+
+
 @cython.optimize.use_switch(False)
 cdef int sig_raise_exception "sig_raise_exception"(int sig, const char* msg) except 0 with gil:
     """
@@ -129,6 +216,25 @@ cdef int sig_raise_exception "sig_raise_exception"(int sig, const char* msg) exc
     if PyErr_Occurred():
         return 0
 
+    cdef int cache = -1
+    if cache_interrupts:
+        if sig == SIGINT:
+            cache = 0
+        elif sig == SIGALRM:
+            cache = 1
+
+    cdef PyObject* exc
+    if cache >= 0:
+        exc = cached_interrupts[cache]
+        if exc is not NULL and sig_exception_reusable(exc):
+            # PyErr_SetObject() sets __context__ like for a new
+            # exception, which makes it non-reusable.
+            PyErr_SetObject(type(<object>exc), <object>exc)
+            Py_XINCREF(exc)
+            Py_XDECREF(cysigs.exc_value)
+            cysigs.exc_value = exc
+            return 0
+
     # Make sure to check the standard signals from the C standard first,
     # in case systems alias some of these constants.
     if sig == SIGILL:
@@ -160,6 +266,13 @@ cdef int sig_raise_exception "sig_raise_exception"(int sig, const char* msg) exc
         if msg is NULL:
             msg = "Bus error"
         PyErr_SetString(SignalError, msg)
+    elif sig == SIG_CANCEL:
+        PyErr_SetNone(CancelInterrupt)
+    elif sig == SIG_MAPPED_FILE:
+        name = mapped_fault_name.decode("utf-8", "replace")
+        err = MappedFileError(EIO, "Bus error at offset %s of mapped file" % mapped_fault_offset, name)
+        err.offset = mapped_fault_offset
+        PyErr_SetObject(MappedFileError, err)
     else:
         PyErr_Format(SystemError, "unknown signal number %i", sig)
 
@@ -172,11 +285,43 @@ cdef int sig_raise_exception "sig_raise_exception"(int sig, const char* msg) exc
     Py_XINCREF(val)
     Py_XDECREF(cysigs.exc_value)
     cysigs.exc_value = val
+    if cache >= 0 and val is not NULL:
+        Py_XINCREF(val)
+        Py_XDECREF(cached_interrupts[cache])
+        cached_interrupts[cache] = val
     PyErr_Restore(typ, val, tb)
 
     return 0
 
 
+def set_exception_cache(bint enable):
+    """
+    Enable or disable reusing exception instances for interrupts
+    (``SIGINT`` and ``SIGALRM``). This is enabled by default; it only
+    makes a difference when many interrupts are raised. Return the
+    previous setting.
+
+    A cached instance is only raised again when nothing refers to it
+    anymore, so exceptions which are kept by the caller are never
+    modified::
+
+        >>> from cysignals.signals import set_exception_cache
+        >>> from cysignals.tests import test_interrupt_exceptions
+        >>> a, b = test_interrupt_exceptions(2)
+        >>> a is b, type(a).__name__
+        (False, 'AlarmInterrupt')
+        >>> set_exception_cache(False)
+        True
+        >>> set_exception_cache(True)
+        False
+
+    """
+    global cache_interrupts
+    old = cache_interrupts
+    cache_interrupts = enable
+    return old
+
+
 def sig_print_exception(sig, msg=None):
     """
     Python version of :func:`sig_raise_exception` which prints the
@@ -268,6 +413,86 @@ def _setup_alt_stack():
     setup_alt_stack()
 
 
+def set_alt_stack_size(size_t size):
+    """
+    Set the size in bytes of the alternate signal stacks allocated from
+    now on and return the previous size (``0`` means the default).
+
+    Every thread gets its own alternate signal stack, installed by the
+    first ``sig_on()`` in that thread. Threads which already have an
+    alternate stack keep it. A larger stack can be needed if the
+    signal handler itself runs out of stack space.
+
+    EXAMPLES::
+
+        >>> from cysignals.signals import set_alt_stack_size
+        >>> set_alt_stack_size(1 << 20)
+        0
+        >>> set_alt_stack_size(0)
+        1048576
+
+    """
+    return sig_set_alt_stack_size(size)
+
+
+def start_watchdog(double warn=1.0, grace=None, action="interrupt"):
+    """
+    Start a thread which watches for interrupts which stay pending
+    inside ``sig_on()``, for example because they are received during
+    ``sig_block()``.
+
+    If an interrupt has been pending for ``warn`` seconds, a
+    diagnostic with the ``sig_str()`` message and the location of the
+    ``sig_on()`` is printed to ``stderr``. If ``grace`` is given, the
+    watchdog escalates after ``grace`` seconds depending on
+    ``action``:
+
+    - ``"log"``: do nothing more.
+
+    - ``"interrupt"``: jump back to ``sig_on()`` and raise the
+      exception anyway. This is unsafe if the blocked code holds locks
+      or has data in an inconsistent state.
+
+    - ``"terminate"``: send ``SIGTERM`` to the process.
+
+    EXAMPLES::
+
+        >>> from cysignals.signals import start_watchdog, stop_watchdog
+        >>> start_watchdog(0.5, 2.0)
+        >>> start_watchdog()
+        Traceback (most recent call last):
+        ...
+        RuntimeError: the watchdog is already running
+        >>> stop_watchdog()
+        >>> start_watchdog(action="reboot")
+        Traceback (most recent call last):
+        ...
+        ValueError: unknown watchdog action 'reboot'
+
+    """
+    cdef int act
+    if action == "log":
+        act = WATCHDOG_LOG
+    elif action == "interrupt":
+        act = WATCHDOG_INTERRUPT
+    elif action == "terminate":
+        act = WATCHDOG_TERMINATE
+    else:
+        raise ValueError(f"unknown watchdog action {action!r}")
+    cdef double g = 0 if grace is None else grace
+    if sig_watchdog_start(warn, g, act):
+        raise RuntimeError("the watchdog is already running")
+
+
+def stop_watchdog():
+    """
+    Stop the watchdog started by :func:`start_watchdog`. Do nothing if
+    it is not running.
+    """
+    with nogil:
+        sig_watchdog_stop()
+
+
 def set_debug_level(int level):
     """
     Set the cysignals debug level and return the old debug level.
@@ -311,6 +536,496 @@ def sig_on_reset():
     return s
 
 
+# Python shrinkers registered with register_shrinker(). We keep a
+# reference here since the C registry only stores a borrowed pointer.
+cdef dict python_shrinkers = {}
+
+cdef size_t python_shrinker(size_t needed, void* callback) with gil:
+    """
+    Call a Python shrinker registered with :func:`register_shrinker`.
+    Exceptions are printed and otherwise ignored.
+    """
+    try:
+        freed = (<object>callback)(needed)
+        return freed if freed else 0
+    except BaseException:
+        import traceback
+        traceback.print_exc()
+        return 0
+
+
+def register_shrinker(callback, int priority=0):
+    """
+    Register a Python function ``callback(needed)`` which is called
+    when an allocation of ``needed`` bytes in one of the ``sig_`` or
+    ``check_`` allocation functions from ``cysignals.memory`` fails.
+    It should free memory (for example by clearing a cache) and return
+    the number of bytes freed. If it returns a non-zero value, the
+    allocation is retried before any other shrinker is called.
+
+    Shrinkers with a lower ``priority`` are called first. C code can
+    register shrinkers with ``sig_register_shrinker()``. These are
+    called without the GIL.
+
+    EXAMPLES::
+
+        >>> from cysignals.signals import register_shrinker, unregister_shrinker
+        >>> from cysignals.tests import test_shrinkers
+        >>> cache = [bytearray(1000)]
+        >>> def drop_cache(needed):
+        ...     print("need {} bytes".format(needed))
+        ...     return sum(len(c) for c in cache)
+        >>> register_shrinker(drop_cache)
+        >>> try:
+        ...     test_shrinkers()
+        ... except MemoryError:
+        ...     print("MemoryError")
+        need 1152921504606846976 bytes
+        MemoryError
+        >>> unregister_shrinker(drop_cache)
+        >>> test_shrinkers()
+        Traceback (most recent call last):
+        ...
+        MemoryError: failed to allocate 1152921504606846976 bytes
+
+    """
+    if callback in python_shrinkers:
+        raise ValueError("shrinker is already registered")
+    if sig_register_shrinker(<sig_shrinker_func>python_shrinker, <void*>callback, priority):
+        raise RuntimeError("too many shrinkers registered")
+    python_shrinkers[callback] = priority
+
+
+def unregister_shrinker(callback):
+    """
+    Unregister a shrinker registered with :func:`register_shrinker`.
+
+    EXAMPLES::
+
+        >>> from cysignals.signals import unregister_shrinker
+        >>> unregister_shrinker(print)
+        Traceback (most recent call last):
+        ...
+        ValueError: shrinker is not registered
+
+    """
+    if callback not in python_shrinkers:
+        raise ValueError("shrinker is not registered")
+    sig_unregister_shrinker(<sig_shrinker_func>python_shrinker, <void*>callback)
+    del python_shrinkers[callback]
+
+
+def quota_usage():
+    """
+    Return the net number of bytes allocated and its peak during the
+    active or last ``sig_on_quota()`` region of the calling thread, as
+    a tuple ``(current, peak)``. Only memory allocated by the
+    ``sig_malloc`` family from ``cysignals.memory`` is counted, and only
+    on systems with ``malloc_usable_size()``.
+
+    EXAMPLES::
+
+        >>> from cysignals.signals import quota_usage
+        >>> current, peak = quota_usage()
+        >>> 0 <= peak
+        True
+
+    """
+    return sig_quota_current(), sig_quota_peak()
+
+
+# Python callbacks run by sig_check() when requested by the yield timer
+yield_callbacks = []
+cdef double yield_interval = 0
+
+
+cdef void sig_run_yield_callbacks "sig_run_yield_callbacks"() with gil:
+    """
+    Run the callbacks registered with :func:`register_yield_callback`.
+    Exceptions are printed and otherwise ignored. This also runs the
+    subscribers of pending control events.
+    """
+    drain_control_events()
+    for callback in list(yield_callbacks):
+        try:
+            callback()
+        except BaseException:
+            import traceback
+            traceback.print_exc()
+
+
+def register_yield_callback(callback):
+    """
+    Register a Python function ``callback()`` which is called
+    periodically from ``sig_check()``, even inside long computations
+    without the GIL. This can be used for progress reporting or
+    heartbeats. The period is set with :func:`set_yield_interval`.
+
+    The callbacks run with the GIL and with interrupts deferred until
+    they finish. Exceptions raised by a callback are printed and then
+    ignored.
+
+    EXAMPLES::
+
+        >>> from cysignals.signals import *
+        >>> from cysignals.tests import test_yield
+        >>> calls = []
+        >>> register_yield_callback(lambda: calls.append(1))
+        >>> set_yield_interval(0.02)
+        0.0
+        >>> test_yield(200)
+        >>> len(calls) >= 2
+        True
+        >>> set_yield_interval(0)
+        0.02
+        >>> unregister_yield_callback(calls.append)
+        Traceback (most recent call last):
+        ...
+        ValueError: yield callback is not registered
+        >>> del yield_callbacks[:]
+
+    """
+    yield_callbacks.append(callback)
+
+
+def unregister_yield_callback(callback):
+    """
+    Unregister a callback registered with
+    :func:`register_yield_callback`.
+    """
+    try:
+        yield_callbacks.remove(callback)
+    except ValueError:
+        raise ValueError("yield callback is not registered")
+
+
+def set_yield_interval(double interval):
+    """
+    Request ``sig_check()`` to run the yield callbacks every
+    ``interval`` seconds. A non-positive interval disables this.
+    Return the previous interval.
+    """
+    global yield_interval
+    if sig_set_yield_interval(interval):
+        yield_interval = 0
+        raise RuntimeError("cannot start the yield timer")
+    old = yield_interval
+    yield_interval = interval if interval > 0 else 0
+    return old
+
+
+# Subscribers of control events, as dict signal number -> list of
+# callbacks, and the Python handlers replaced by python_control_handler
+cdef dict control_subscribers = {}
+cdef dict control_old_handlers = {}
+
+from collections import namedtuple
+ControlEvent = namedtuple("ControlEvent", ["signum", "value", "pid", "uid"])
+
+
+cdef drain_control_events():
+    """
+    Pass the events received by the control handler in
+    ``implementation.c`` to the subscribed callbacks. Exceptions are
+    printed and otherwise ignored.
+    """
+    cdef int signum, value
+    cdef long pid, uid
+    while sig_control_pop(&signum, &value, &pid, &uid):
+        event = ControlEvent(signum, value, pid, uid)
+        for callback in list(control_subscribers.get(signum, ())):
+            try:
+                callback(event)
+            except BaseException:
+                import traceback
+                traceback.print_exc()
+
+
+def python_control_handler(sig, frame):
+    """
+    Python-level handler for control signals. The events themselves
+    are queued by the OS-level handler, this only drains the queue.
+    """
+    drain_control_events()
+
+
+def _control_signum(signum):
+    if signum is None:
+        import signal
+        return signal.SIGRTMIN
+    return signum
+
+
+def subscribe_control(callback, signum=None):
+    """
+    Call ``callback(event)`` for every control event received as
+    signal ``signum`` (by default ``SIGRTMIN``). Control events are
+    typically sent by a supervising process with :func:`send_control`
+    or ``sigqueue()``. The ``event`` is a :class:`ControlEvent` with
+    the signal number, the integer payload and the pid and uid of the
+    sender.
+
+    The callbacks run in the main thread like Python signal handlers.
+    Inside ``sig_on()``, they run from the next ``sig_check()``, like
+    the callbacks of :func:`register_yield_callback`. Events are
+    queued with their payload, so that events sent in quick succession
+    are not lost (up to the queue size of 256 events).
+
+    EXAMPLES::
+
+        >>> from cysignals.signals import *
+        >>> import os, time
+        >>> events = []
+        >>> subscribe_control(events.append)
+        >>> send_control(os.getpid(), 42)
+        >>> send_control(os.getpid(), 7)
+        >>> time.sleep(0.01)
+        >>> [e.value for e in events]
+        [42, 7]
+        >>> events[0].pid == os.getpid()
+        True
+        >>> unsubscribe_control(events.append)
+
+    Control events arriving during a long computation are handled by
+    ``sig_check()``::
+
+        >>> from cysignals.tests import test_control_event
+        >>> subscribe_control(events.append)
+        >>> test_control_event(13)
+        >>> events[-1].value
+        13
+        >>> unsubscribe_control(events.append)
+        >>> unsubscribe_control(events.append)
+        Traceback (most recent call last):
+        ...
+        ValueError: control callback is not subscribed
+
+    """
+    signum = _control_signum(signum)
+    if signum not in control_subscribers:
+        import signal
+        old = signal.signal(signum, python_control_handler)
+        if sig_control_install(signum):
+            signal.signal(signum, old)
+            PyErr_SetFromErrno(OSError)
+        control_old_handlers[signum] = old
+        control_subscribers[signum] = []
+    control_subscribers[signum].append(callback)
+
+
+def unsubscribe_control(callback, signum=None):
+    """
+    Unsubscribe a callback subscribed with :func:`subscribe_control`.
+    When no callbacks are left, the original handler of ``signum`` is
+    restored.
+    """
+    signum = _control_signum(signum)
+    callbacks = control_subscribers.get(signum, [])
+    try:
+        callbacks.remove(callback)
+    except ValueError:
+        raise ValueError("control callback is not subscribed")
+    if not callbacks:
+        import signal
+        sig_control_uninstall(signum)
+        signal.signal(signum, control_old_handlers.pop(signum))
+        del control_subscribers[signum]
+
+
+def send_control(pid, int value, signum=None):
+    """
+    Send a control event with payload ``value`` to the process
+    ``pid`` using ``sigqueue()``.
+    """
+    if sig_control_send(pid, _control_signum(signum), value):
+        PyErr_SetFromErrno(OSError)
+
+
+def control_events_dropped():
+    """
+    Return the number of control events which were dropped because
+    the queue was full.
+    """
+    return sig_control_dropped()
+
+
+# The CancelFlags whose flags are watched by this process, kept alive
+# while cysigs.cancel_flags may point to them
+cdef CancelFlags watched_cancel_flags = None
+
+
+cdef class CancelFlags:
+    """
+    Cancellation flags for jobs running in worker processes.
+
+    The flags are ``int`` words in shared memory: by default, an
+    anonymous shared mapping which is inherited by processes forked
+    after creating the :class:`CancelFlags`. Alternatively, a writable
+    ``buffer`` of at least ``(njobs + 1) * sizeof(int)`` bytes can be
+    given, for example the ``buf`` of a
+    ``multiprocessing.shared_memory.SharedMemory``.
+
+    A worker process calls :meth:`watch` with the index of the job it
+    is about to run. Then ``sig_on()`` and ``sig_check()`` raise
+    :class:`CancelInterrupt` when the parent cancels that job (or all
+    jobs) with :meth:`cancel`. This is a plain store to shared memory,
+    no signal is sent. ``sig_on()`` checks the flags directly, while
+    ``sig_check()`` notices a cancellation within about 10 milliseconds
+    through a thread polling the flags, which keeps ``sig_check()``
+    cheap. A cancellation is raised only once, after which the worker no longer
+    watches the flags. Inside ``sig_on()``, it is only noticed by
+    ``sig_check()``, so code which does not call ``sig_check()`` cannot
+    be cancelled this way.
+
+    EXAMPLES::
+
+        >>> from cysignals.signals import CancelFlags
+        >>> import os
+        >>> flags = CancelFlags(4)
+        >>> len(flags)
+        4
+        >>> pid = os.fork()
+        >>> if pid == 0:
+        ...     while not flags.is_cancelled(2):
+        ...         pass
+        ...     os._exit(0)
+        >>> flags.is_cancelled(2)
+        False
+        >>> flags.cancel(2)
+        >>> os.waitpid(pid, 0)[1]
+        0
+        >>> flags.is_cancelled(1), flags.is_cancelled(2)
+        (False, True)
+        >>> flags.cancel()
+        >>> flags.is_cancelled(1)
+        True
+        >>> flags.reset()
+        >>> flags.is_cancelled(1), flags.is_cancelled(2)
+        (False, False)
+        >>> flags.cancel(4)
+        Traceback (most recent call last):
+        ...
+        IndexError: job index out of range
+
+    Using a buffer::
+
+        >>> buf = bytearray(64)
+        >>> flags = CancelFlags(3, buf)
+        >>> flags.cancel(0)
+        >>> any(buf)
+        True
+        >>> CancelFlags(100, buf)
+        Traceback (most recent call last):
+        ...
+        ValueError: buffer too small for 100 cancellation flags
+
+    """
+    cdef int* flags
+    cdef Py_ssize_t njobs
+    cdef size_t size
+    cdef bint mapped
+    cdef bint has_view
+    cdef Py_buffer view
+
+    def __cinit__(self, Py_ssize_t njobs=1, buffer=None):
+        if njobs < 1:
+            raise ValueError("the number of jobs must be positive")
+        self.njobs = njobs
+        # Word 0 cancels all jobs, word i+1 cancels job i
+        self.size = (njobs + 1) * sizeof(int)
+
+        cdef void* p
+        if buffer is None:
+            p = mmap(NULL, self.size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0)
+            if p == MAP_FAILED:
+                PyErr_SetFromErrno(OSError)
+            self.mapped = True
+        else:
+            PyObject_GetBuffer(buffer, &self.view, PyBUF_WRITABLE)
+            self.has_view = True
+            if <size_t>self.view.len < self.size:
+                raise ValueError("buffer too small for %d cancellation flags" % njobs)
+            p = self.view.buf
+            if <size_t>p % sizeof(int):
+                raise ValueError("buffer is not aligned")
+        self.flags = <int*>p
+
+    def __dealloc__(self):
+        if self.flags is not NULL and cysigs.cancel_flags == self.flags:
+            cysigs.cancel_flags = NULL
+        if self.mapped:
+            munmap(self.flags, self.size)
+        if self.has_view:
+            PyBuffer_Release(&self.view)
+
+    def __len__(self):
+        return self.njobs
+
+    cdef Py_ssize_t slot(self, job) except -1:
+        if job is None:
+            return 0
+        cdef Py_ssize_t i = job
+        if not 0 <= i < self.njobs:
+            raise IndexError("job index out of range")
+        return i + 1
+
+    def cancel(self, job=None):
+        """
+        Cancel job number ``job``, or all jobs if ``job`` is ``None``.
+        """
+        cdef volatile int* flags = self.flags
+        flags[self.slot(job)] = 1
+
+    def reset(self, job=None):
+        """
+        Clear the cancellation of job number ``job``, or of all jobs
+        if ``job`` is ``None``.
+        """
+        cdef volatile int* flags = self.flags
+        cdef Py_ssize_t i
+        if job is None:
+            for i in range(self.njobs + 1):
+                flags[i] = 0
+        else:
+            flags[self.slot(job)] = 0
+
+    def is_cancelled(self, job):
+        """
+        Has job number ``job`` been cancelled?
+        """
+        cdef volatile int* flags = self.flags
+        return bool(flags[0] or flags[self.slot(job)])
+
+    def watch(self, job):
+        """
+        Make ``sig_on()`` and ``sig_check()`` in this process raise
+        :class:`CancelInterrupt` when job number ``job`` is cancelled.
+        This replaces flags watched before.
+        """
+        global watched_cancel_flags
+        if job is None:
+            raise TypeError("watch() needs a job index")
+        cdef Py_ssize_t i = self.slot(job)
+        if sig_set_cancel_watcher(1):
+            raise RuntimeError("cannot start the cancellation watcher")
+        cysigs.cancel_flags = NULL
+        cysigs.cancel_slot = i
+        watched_cancel_flags = self
+        cysigs.cancel_flags = self.flags
+
+    def unwatch(self):
+        """
+        Stop watching these flags.
+        """
+        global watched_cancel_flags
+        if cysigs.cancel_flags == self.flags:
+            cysigs.cancel_flags = NULL
+        if watched_cancel_flags is self:
+            watched_cancel_flags = None
+            sig_set_cancel_watcher(0)
+
+
 def python_check_interrupt(sig, frame):
     """
     Python-level interrupt handler for interrupts raised in Python
@@ -320,12 +1035,24 @@ def python_check_interrupt(sig, frame):
     sig_check()
 
 
+cdef inline bint exc_value_unreferenced():
+    """
+    Is ``cysigs.exc_value`` only referenced by ``cysignals`` itself
+    (``cysigs.exc_value`` and possibly the cache of interrupts)?
+    """
+    cdef Py_ssize_t refs = 1
+    if (cysigs.exc_value is cached_interrupts[0] or
+            cysigs.exc_value is cached_interrupts[1]):
+        refs = 2
+    return cysigs.exc_value.ob_refcnt == refs
+
+
 cdef void verify_exc_value():
     """
     Check that ``cysigs.exc_value`` is still the exception being raised.
     Clear ``cysigs.exc_value`` if not.
     """
-    if cysigs.exc_value.ob_refcnt == 1:
+    if exc_value_unreferenced():
         # No other references => exception is certainly gone
         Py_XDECREF(cysigs.exc_value)
         cysigs.exc_value = NULL
@@ -372,6 +1099,6 @@ cdef void verify_exc_value():
         # is not functional anymore.
         pass
 
-    if cysigs.exc_value.ob_refcnt == 1:
+    if exc_value_unreferenced():
         Py_XDECREF(cysigs.exc_value)
         cysigs.exc_value = NULL
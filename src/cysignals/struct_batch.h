@@ -0,0 +1,57 @@
+/*
+Types of the batch evaluation, see batch.h. They are kept apart from
+the functions like those of sync.h, see struct_sync.h.
+*/
+
+/*****************************************************************************
+ *  cysignals is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU Lesser General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  cysignals is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef CYSIGNALS_STRUCT_BATCH_H
+#define CYSIGNALS_STRUCT_BATCH_H
+
+#include <Python.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Function evaluating item ``i`` of a batch, see batch.h */
+typedef void (*sig_batch_func)(size_t i, void* arg);
+
+/* Summary of the failed items of a batch, see batch.h */
+typedef struct
+{
+    /* Number of failed items */
+    size_t nfailed;
+
+    /* Index of the first failed item, or (size_t)-1 if none failed */
+    size_t first_failed;
+
+    /* Signal number of the first failure */
+    int first_signal;
+
+    /* Exception raised for the first failure (a new reference, to be
+     * released by the caller) or NULL */
+    PyObject* first_exc;
+} sig_batch_status_t;
+
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* ifndef CYSIGNALS_STRUCT_BATCH_H */
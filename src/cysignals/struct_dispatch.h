@@ -0,0 +1,58 @@
+/*
+Types of the dispatch between kernel variants, see dispatch.h. They
+are kept apart from the functions like those of sync.h, see
+struct_sync.h.
+*/
+
+/*****************************************************************************
+ *  cysignals is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU Lesser General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  cysignals is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef CYSIGNALS_STRUCT_DISPATCH_H
+#define CYSIGNALS_STRUCT_DISPATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* A variant of a kernel, "arg" points to its arguments. A kernel is
+ * dispatched between its variants with a sig_dispatch_t, see
+ * dispatch.h. */
+typedef void (*sig_kernel_t)(void* arg);
+
+typedef struct
+{
+    /* Name of the kernel, used in error messages */
+    const char* name;
+
+    /* The variants, from the most to the least preferred one */
+    const sig_kernel_t* variants;
+    int nvariants;
+
+    /* Index of the variant to use: all variants before it died from
+     * SIGILL. This is nvariants if no variant works. */
+    volatile int selected;
+
+    /* Did the selected variant complete successfully? */
+    volatile int verified;
+} sig_dispatch_t;
+
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* ifndef CYSIGNALS_STRUCT_DISPATCH_H */
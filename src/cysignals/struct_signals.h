@@ -23,14 +23,46 @@
 
 
 #include "cysignals_config.h"
+#include <stddef.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <pthread.h>
 
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Maximum nesting depth of sig_on_local() with its own jump buffer.
+ * Deeper sig_on_local() calls behave like a nested sig_on(). */
+#define SIG_LOCAL_MAX 16
+
+/* Flags for sig_on_local() */
+#define SIG_LOCAL_INTERRUPTS 1  /* Also handle interrupts locally */
+
+/* Pseudo signal number used for raising CancelInterrupt when a
+ * cancellation flag is set, see cysigs.cancel_flags. It does not
+ * correspond to a real signal. */
+#define SIG_CANCEL 0x10000
+
+/* Pseudo signal number used for raising MappedFileError for a SIGBUS
+ * on a file mapped with sig_mmap_file() */
+#define SIG_MAPPED_FILE 0x10001
+
+/* A scope opened by sig_on_local() */
+typedef struct
+{
+    /* Where to jump to for a signal handled by this scope */
+    cyjmp_buf env;
+
+    /* Values of cysigs.sig_on_count and cysigs.block_sigint before
+     * this scope, to be restored when jumping to it. */
+    sig_atomic_t sig_on_count;
+    sig_atomic_t block_sigint;
+
+    int flags;
+} cysigs_local_t;
+
 /* All the state of the signal handler is in this struct. */
 typedef struct
 {
@@ -57,6 +89,24 @@ typedef struct
      * See sig_block(), sig_unblock(). */
     volatile sig_atomic_t block_sigint;
 
+    /* Requests the slow path of sig_check(). Set periodically by the
+     * yield timer (see _sig_yield()), by the control channel and by the
+     * watcher of the cancellation flags. */
+    volatile sig_atomic_t yield_requested;
+
+    /* Cancellation flags, typically in memory shared with a parent
+     * process (NULL if none are watched). sig_on() and sig_check()
+     * raise CancelInterrupt if cancel_flags[0] (cancelling every job)
+     * or cancel_flags[cancel_slot] (cancelling the current job) is
+     * nonzero. See CancelFlags in signals.pyx. */
+    volatile int* volatile cancel_flags;
+    int cancel_slot;
+
+    /* Number of active sig_on_quota() regions, of any thread. Each
+     * region ends at the matching sig_off() or when jumping out of it.
+     * The regions themselves are kept per thread in implementation.c. */
+    volatile sig_atomic_t quota_depth;
+
     /* A jump buffer holding where to cylongjmp() after a signal has
      * been received. This is set by sig_on(). */
     cyjmp_buf env;
@@ -67,15 +117,45 @@ typedef struct
      * be set using sig_str() instead of sig_on(). */
     const char* s;
 
+    /* Source location of the outermost sig_on(), used for diagnostics
+     * by the stall watchdog. */
+    const char* file;
+    int line;
+
+    /* The thread which executed the outermost sig_on(). The blocking
+     * primitives of sync.h use this such that only this thread blocks
+     * or re-raises interrupts for that sig_on(), see _sig_on_thread(). */
+    pthread_t thread;
+
     /* Reference to the exception object that we raised (NULL if none).
      * This is used by the sig_occurred function. */
     PyObject* exc_value;
 
+    /* Stack of scopes opened by sig_on_local(). Critical signals jump
+     * to the innermost scope, interrupts to the outermost sig_on()
+     * unless a scope has the SIG_LOCAL_INTERRUPTS flag. Only the first
+     * SIG_LOCAL_MAX entries are used. */
+    volatile sig_atomic_t local_depth;
+    cysigs_local_t local[SIG_LOCAL_MAX];
+
 #if ENABLE_DEBUG_CYSIGNALS
     int debug_level;
 #endif
 } cysigs_t;
 
+/* Function computing the contents of a page of a lazy array, see
+ * sig_lazy_malloc(): fill ``page`` with ``len`` bytes corresponding to
+ * the bytes of the array starting at ``offset``. */
+typedef void (*sig_lazy_fill_func)(void* page, size_t offset, size_t len, void* arg);
+
+/* Function called when an allocation of ``needed`` bytes fails, see
+ * sig_register_shrinker(). It returns the number of bytes freed. */
+typedef size_t (*sig_shrinker_func)(size_t needed, void* arg);
+
+/* Function called after jumping back to sig_on() for a library which
+ * registered its interrupt protocol with sig_register_protocol(). */
+typedef void (*sig_recover_func)(void* arg);
+
 #ifdef __cplusplus
 }  /* extern "C" */
 #endif
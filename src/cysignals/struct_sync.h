@@ -0,0 +1,70 @@
+/*
+Types of the interruptible blocking primitives, see sync.h. Like
+struct_signals.h for macros.h, they are kept apart from the functions
+such that Cython can include them before the module declares cysigs.
+*/
+
+/*****************************************************************************
+ *  cysignals is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU Lesser General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  cysignals is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef CYSIGNALS_STRUCT_SYNC_H
+#define CYSIGNALS_STRUCT_SYNC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* The sequence words (the futex words) may be incremented at any time
+ * by the interrupt handler to wake up waiters. */
+typedef struct
+{
+    volatile int state;   /* 0: unlocked, 1: locked, 2: locked with waiters */
+    volatile int seq;
+} sig_mutex_t;
+
+typedef struct
+{
+    volatile int seq;
+    volatile int waiters;
+} sig_cond_t;
+
+typedef struct
+{
+    volatile int value;
+    volatile int seq;
+    volatile int waiters;
+} sig_sem_t;
+
+typedef struct
+{
+    void** items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    sig_mutex_t lock;
+    sig_cond_t not_empty;
+    sig_cond_t not_full;
+} sig_queue_t;
+
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* ifndef CYSIGNALS_STRUCT_SYNC_H */
@@ -0,0 +1,322 @@
+/*
+Interruptible blocking primitives for code running without the GIL.
+
+These are a mutex, a condition variable, a counting semaphore and a
+bounded multi-producer multi-consumer queue. Unlike the pthread
+versions, waiting for them reacts to interrupts: inside sig_on(), an
+interrupt jumps back to sig_on() as usual. Outside sig_on(), a pending
+interrupt wakes up the waiting thread, which raises the exception like
+sig_check() and returns 0.
+
+The functions which may wait return 1 on success and 0 if an exception
+was raised. When waiting is interrupted, the mutex passed to
+sig_cond_wait() is no longer held.
+
+Holding a sig_mutex_t does not block interrupts: inside sig_on(), an
+interrupt can jump out of code holding the mutex, which then stays
+locked. Use sig_block() and sig_unblock() around such code. The queue
+does this itself: in the thread inside sig_on(), its lock is only held
+with interrupts blocked, so an interrupt never leaves it locked.
+
+The waits use futex() on Linux. On other systems, they poll for
+wakeups and interrupts every 10 milliseconds.
+*/
+
+/*****************************************************************************
+ *  cysignals is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU Lesser General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  cysignals is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef CYSIGNALS_SYNC_H
+#define CYSIGNALS_SYNC_H
+
+#include <limits.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "struct_sync.h"
+#include "macros.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Called when a wait was abandoned because of a pending interrupt.
+ * In the thread inside sig_on(), re-raise the interrupt to jump back
+ * to sig_on(). Outside sig_on(), raise the exception and return 0,
+ * unless another thread dealt with the interrupt first. A thread
+ * waiting while another thread is inside sig_on() raises the exception
+ * and returns 0 too, but leaves the interrupt pending for that thread:
+ * it must not jump to the sig_on() of another thread. */
+static inline int _sig_sync_interrupted(void)
+{
+    int sig = cysigs.interrupt_received;
+    if (_sig_on_thread())
+    {
+        if (sig && cysigs.block_sigint == 0) raise(sig);
+        return sig_check();
+    }
+    if (cysigs.sig_on_count == 0) return sig_check();
+    if (!sig) return 1;
+    _sig_raise_pending();
+    return 0;
+}
+
+
+/**********************************************************************
+ * MUTEX                                                              *
+ **********************************************************************/
+
+static inline void sig_mutex_init(sig_mutex_t* m)
+{
+    m->state = 0;
+    m->seq = 0;
+}
+
+static inline int sig_mutex_trylock(sig_mutex_t* m)
+{
+    return __sync_bool_compare_and_swap(&m->state, 0, 1);
+}
+
+static inline int sig_mutex_lock(sig_mutex_t* m)
+{
+    if (likely(__sync_bool_compare_and_swap(&m->state, 0, 1))) return 1;
+    for (;;)
+    {
+        int s = m->seq;
+        if (__atomic_exchange_n(&m->state, 2, __ATOMIC_SEQ_CST) == 0) return 1;
+        if (!_sig_futex_wait((int*)&m->seq, s) && !_sig_sync_interrupted())
+            return 0;
+    }
+}
+
+static inline void sig_mutex_unlock(sig_mutex_t* m)
+{
+    if (__atomic_exchange_n(&m->state, 0, __ATOMIC_SEQ_CST) == 2)
+    {
+        __sync_fetch_and_add(&m->seq, 1);
+        _sig_futex_wake((int*)&m->seq, 1);
+    }
+}
+
+
+/**********************************************************************
+ * CONDITION VARIABLE                                                 *
+ **********************************************************************/
+
+static inline void sig_cond_init(sig_cond_t* c)
+{
+    c->seq = 0;
+    c->waiters = 0;
+}
+
+/* Like pthread_cond_wait(), wakeups may be spurious */
+static inline int sig_cond_wait(sig_cond_t* c, sig_mutex_t* m)
+{
+    __sync_fetch_and_add(&c->waiters, 1);
+    int s = c->seq;
+    sig_mutex_unlock(m);
+    int ok = _sig_futex_wait((int*)&c->seq, s);
+    __sync_fetch_and_sub(&c->waiters, 1);
+    if (!ok && !_sig_sync_interrupted()) return 0;
+    return sig_mutex_lock(m);
+}
+
+static inline void sig_cond_signal(sig_cond_t* c)
+{
+    __sync_fetch_and_add(&c->seq, 1);
+    if (c->waiters) _sig_futex_wake((int*)&c->seq, 1);
+}
+
+static inline void sig_cond_broadcast(sig_cond_t* c)
+{
+    __sync_fetch_and_add(&c->seq, 1);
+    if (c->waiters) _sig_futex_wake((int*)&c->seq, INT_MAX);
+}
+
+
+/**********************************************************************
+ * SEMAPHORE                                                          *
+ **********************************************************************/
+
+static inline void sig_sem_init(sig_sem_t* sem, int value)
+{
+    sem->value = value;
+    sem->seq = 0;
+    sem->waiters = 0;
+}
+
+static inline int sig_sem_trywait(sig_sem_t* sem)
+{
+    int v;
+    while ((v = sem->value) > 0)
+        if (__sync_bool_compare_and_swap(&sem->value, v, v - 1)) return 1;
+    return 0;
+}
+
+static inline int sig_sem_wait(sig_sem_t* sem)
+{
+    for (;;)
+    {
+        if (sig_sem_trywait(sem)) return 1;
+        __sync_fetch_and_add(&sem->waiters, 1);
+        int s = sem->seq;
+        int ok = 1;
+        if (sem->value <= 0) ok = _sig_futex_wait((int*)&sem->seq, s);
+        __sync_fetch_and_sub(&sem->waiters, 1);
+        if (!ok && !_sig_sync_interrupted()) return 0;
+    }
+}
+
+static inline void sig_sem_post(sig_sem_t* sem)
+{
+    __sync_fetch_and_add(&sem->value, 1);
+    __sync_fetch_and_add(&sem->seq, 1);
+    if (sem->waiters) _sig_futex_wake((int*)&sem->seq, 1);
+}
+
+
+/**********************************************************************
+ * BOUNDED QUEUE                                                      *
+ **********************************************************************/
+
+/* Return 0 on success, -1 if memory could not be allocated */
+static inline int sig_queue_init(sig_queue_t* q, size_t capacity)
+{
+    if (capacity == 0) {errno = EINVAL; return -1;}
+    q->items = (void**)malloc(capacity * sizeof(void*));
+    if (!q->items) return -1;
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    sig_mutex_init(&q->lock);
+    sig_cond_init(&q->not_empty);
+    sig_cond_init(&q->not_full);
+    return 0;
+}
+
+static inline void sig_queue_destroy(sig_queue_t* q)
+{
+    free(q->items);
+    q->items = NULL;
+}
+
+static inline void _sig_queue_put(sig_queue_t* q, void* item)
+{
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    sig_cond_signal(&q->not_empty);
+}
+
+static inline void* _sig_queue_get(sig_queue_t* q)
+{
+    void* item = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    sig_cond_signal(&q->not_full);
+    return item;
+}
+
+/* Lock the queue. If the calling thread is inside sig_on(), where an
+ * interrupt could jump out while the lock is held, interrupts are
+ * blocked as long as the lock is held and *blocked is set to 1.
+ * Waiting for the lock is done with interrupts unblocked. Return 0 if
+ * waiting was interrupted (without holding the lock). */
+static inline int _sig_queue_lock(sig_queue_t* q, int* blocked)
+{
+    *blocked = _sig_on_thread();
+    if (*blocked) sig_block();
+    if (likely(sig_mutex_trylock(&q->lock))) return 1;
+    for (;;)
+    {
+        int s = q->lock.seq;
+        if (__atomic_exchange_n(&q->lock.state, 2, __ATOMIC_SEQ_CST) == 0) return 1;
+        if (*blocked) sig_unblock();
+        if (!_sig_futex_wait((int*)&q->lock.seq, s) && !_sig_sync_interrupted())
+            return 0;
+        if (*blocked) sig_block();
+    }
+}
+
+static inline void _sig_queue_unlock(sig_queue_t* q, int blocked)
+{
+    sig_mutex_unlock(&q->lock);
+    if (blocked) sig_unblock();
+}
+
+/* Like sig_cond_wait() for the queue lock taken by _sig_queue_lock():
+ * interrupts are unblocked only after the lock was released */
+static inline int _sig_queue_wait(sig_queue_t* q, sig_cond_t* c, int* blocked)
+{
+    __sync_fetch_and_add(&c->waiters, 1);
+    int s = c->seq;
+    _sig_queue_unlock(q, *blocked);
+    int ok = _sig_futex_wait((int*)&c->seq, s);
+    __sync_fetch_and_sub(&c->waiters, 1);
+    if (!ok && !_sig_sync_interrupted()) return 0;
+    return _sig_queue_lock(q, blocked);
+}
+
+/* Append item, waiting while the queue is full */
+static inline int sig_queue_push(sig_queue_t* q, void* item)
+{
+    int blocked;
+    if (!_sig_queue_lock(q, &blocked)) return 0;
+    while (q->count == q->capacity)
+        if (!_sig_queue_wait(q, &q->not_full, &blocked)) return 0;
+    _sig_queue_put(q, item);
+    _sig_queue_unlock(q, blocked);
+    return 1;
+}
+
+/* Remove the oldest item and store it in *item, waiting while the
+ * queue is empty */
+static inline int sig_queue_pop(sig_queue_t* q, void** item)
+{
+    int blocked;
+    if (!_sig_queue_lock(q, &blocked)) return 0;
+    while (q->count == 0)
+        if (!_sig_queue_wait(q, &q->not_empty, &blocked)) return 0;
+    *item = _sig_queue_get(q);
+    _sig_queue_unlock(q, blocked);
+    return 1;
+}
+
+/* Variants which do not wait for items or free space: return 1 on
+ * success, 0 if the queue is full (or empty) and -1 if waiting for
+ * the lock was interrupted */
+static inline int sig_queue_trypush(sig_queue_t* q, void* item)
+{
+    int ok = 0, blocked;
+    if (!_sig_queue_lock(q, &blocked)) return -1;
+    if (q->count < q->capacity) {_sig_queue_put(q, item); ok = 1;}
+    _sig_queue_unlock(q, blocked);
+    return ok;
+}
+
+static inline int sig_queue_trypop(sig_queue_t* q, void** item)
+{
+    int ok = 0, blocked;
+    if (!_sig_queue_lock(q, &blocked)) return -1;
+    if (q->count > 0) {*item = _sig_queue_get(q); ok = 1;}
+    _sig_queue_unlock(q, blocked);
+    return ok;
+}
+
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* ifndef CYSIGNALS_SYNC_H */
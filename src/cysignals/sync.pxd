@@ -0,0 +1,78 @@
+# cython: preliminary_late_includes_cy28=True
+"""
+Interruptible blocking primitives for code running without the GIL
+
+These are a mutex, a condition variable, a counting semaphore and a
+bounded multi-producer multi-consumer queue of pointers. Waiting for
+them reacts to interrupts like ``sig_check()``: inside ``sig_on()``,
+an interrupt jumps back to ``sig_on()``. Outside ``sig_on()``, the
+waiting thread wakes up and raises the exception.
+
+The functions which may wait are declared ``except 0``. When waiting
+in ``sig_cond_wait`` is interrupted, the mutex is no longer held.
+``sig_queue_init`` returns -1 if the memory for the queue could not
+be allocated. See ``sync.h`` for details.
+"""
+
+#*****************************************************************************
+#  cysignals is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Lesser General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  cysignals is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public License
+#  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+#
+#*****************************************************************************
+
+from .signals cimport _sig_futex_wait, _sig_futex_wake
+
+
+cdef extern from "struct_sync.h":
+    ctypedef struct sig_mutex_t:
+        pass
+    ctypedef struct sig_cond_t:
+        pass
+    ctypedef struct sig_sem_t:
+        int value
+    ctypedef struct sig_queue_t:
+        size_t capacity
+        size_t count
+        sig_mutex_t lock
+
+
+cdef extern from "sync.h" nogil:
+    void sig_mutex_init(sig_mutex_t*)
+    bint sig_mutex_trylock(sig_mutex_t*)
+    int sig_mutex_lock(sig_mutex_t*) except 0
+    void sig_mutex_unlock(sig_mutex_t*)
+
+    void sig_cond_init(sig_cond_t*)
+    int sig_cond_wait(sig_cond_t*, sig_mutex_t*) except 0
+    void sig_cond_signal(sig_cond_t*)
+    void sig_cond_broadcast(sig_cond_t*)
+
+    void sig_sem_init(sig_sem_t*, int value)
+    bint sig_sem_trywait(sig_sem_t*)
+    int sig_sem_wait(sig_sem_t*) except 0
+    void sig_sem_post(sig_sem_t*)
+
+    int sig_queue_init(sig_queue_t*, size_t capacity)
+    void sig_queue_destroy(sig_queue_t*)
+    int sig_queue_push(sig_queue_t*, void* item) except 0
+    int sig_queue_pop(sig_queue_t*, void** item) except 0
+    int sig_queue_trypush(sig_queue_t*, void* item) except -1
+    int sig_queue_trypop(sig_queue_t*, void** item) except -1
+
+    # Variants which are not declared "except", for use in threads
+    # without Python exception handling (like sig_on_no_except)
+    int sig_mutex_lock_no_except "sig_mutex_lock"(sig_mutex_t*)
+    int sig_cond_wait_no_except "sig_cond_wait"(sig_cond_t*, sig_mutex_t*)
+    int sig_sem_wait_no_except "sig_sem_wait"(sig_sem_t*)
+    int sig_queue_push_no_except "sig_queue_push"(sig_queue_t*, void* item)
+    int sig_queue_pop_no_except "sig_queue_pop"(sig_queue_t*, void** item)
@@ -39,24 +39,46 @@ Verify that the doctester was set up correctly::
 
 from __future__ import absolute_import
 
-from libc.signal cimport (SIGHUP, SIGINT, SIGABRT, SIGILL, SIGSEGV,
-        SIGFPE, SIGBUS, SIGQUIT)
+from libc.signal cimport (raise_, SIGHUP, SIGINT, SIGABRT, SIGILL, SIGSEGV,
+        SIGFPE, SIGBUS, SIGQUIT, SIGALRM)
 from libc.stdlib cimport abort
-from posix.signal cimport sigaltstack, stack_t, SS_ONSTACK
+from libc.string cimport memset
+from posix.signal cimport (sigaltstack, stack_t, SS_ONSTACK, sigset_t,
+        sigemptyset, sigaddset, SIG_BLOCK)
 
 from cpython cimport PyErr_SetString
+from cpython.ref cimport Py_XDECREF
 
 from .signals cimport *
 from .memory cimport *
+from .sync cimport *
+from .sigio cimport *
+from .dispatch cimport *
+from .batch cimport *
+from posix.types cimport off_t
+from posix.unistd cimport sysconf, _SC_PAGESIZE
+from posix.uio cimport iovec
 
 cdef extern from "tests_helper.c" nogil:
     bint on_alt_stack()
     void ms_sleep(long ms)
     void signal_after_delay(int signum, long ms)
     void signals_after_delay(int signum, long ms, long interval, int n)
+    void queue_signal(int signum, int value)
+    int start_injector(int signum, long delay, long interval, long jitter, long n, unsigned long seed)
+    bint injector_running()
+    long stop_injector()
 
 cdef extern from *:
     ctypedef int volatile_int "volatile int"
+    long __sync_fetch_and_add(long*, long) nogil
+
+cdef extern from "<pthread.h>" nogil:
+    ctypedef struct pthread_t:
+        pass
+    int pthread_create(pthread_t*, void*, void* (*)(void*) noexcept nogil, void*)
+    int pthread_join(pthread_t, void**)
+    int pthread_sigmask(int, const sigset_t*, sigset_t*)
 
 
 # Default delay in milliseconds before raising signals
@@ -667,6 +689,30 @@ def test_stack_overflow():
         sig_on()
         stack_overflow()
 
+def test_stack_overflow_thread(int n=3):
+    """
+    A stack overflow in any thread is handled on the alternate signal
+    stack of that thread. Alternate stacks of finished threads are
+    reused::
+
+        >>> from cysignals.tests import *
+        >>> test_stack_overflow_thread()
+        [SignalError('Segmentation fault'), SignalError('Segmentation fault'), SignalError('Segmentation fault')]
+
+    """
+    import threading
+    result = []
+    def target():
+        try:
+            test_stack_overflow()
+        except BaseException as e:
+            result.append(e)
+    for i in range(n):
+        t = threading.Thread(target=target)
+        t.start()
+        t.join()
+    return result
+
 def unguarded_stack_overflow():
     """
     TESTS:
@@ -781,6 +827,167 @@ def test_interrupt_bomb(long n=100, long p=10):
     print(f"Received {i}/{n*p} interrupts")
 
 
+def test_interrupt_stress(long n=20000, long interval=10, long jitter=0, unsigned long seed=1):
+    """
+    Hammer ``sig_on()``, ``sig_block()``, ``sig_malloc()``,
+    ``sig_retry()`` and ``sig_check()`` with ``n`` interrupts sent
+    every ``interval`` microseconds (plus a random jitter of at most
+    ``jitter`` microseconds) by a helper thread in this process.
+
+    Return a dict with statistics. After every iteration, the state of
+    ``cysigs`` is checked: ``failures`` counts the violations.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> stats = test_interrupt_stress()
+        >>> stats["sent"], stats["failures"]
+        (20000, 0)
+        >>> stats["interrupts"] > 0
+        True
+
+    With a randomized schedule::
+
+        >>> stats = test_interrupt_stress(5000, 2, 30, seed=42)
+        >>> stats["sent"], stats["failures"]
+        (5000, 0)
+
+    To stress test at production rates, run for example
+    ``test_interrupt_stress(10**7, 1, 5)`` and look at ``stats["rate"]``.
+    """
+    from time import perf_counter
+    cdef long iterations = 0, interrupts = 0, failures = 0
+    cdef volatile_int retries
+    cdef void* p
+
+    t = perf_counter()
+    if start_injector(SIGINT, 0, interval, jitter, n, seed):
+        raise RuntimeError("cannot start signal injector")
+    try:
+        while injector_running():
+            try:
+                with nogil:
+                    retries = 0
+                    sig_on()
+                    sig_block()
+                    p = sig_malloc(64)
+                    sig_free(p)
+                    sig_unblock()
+                    if retries < 2:
+                        retries += 1
+                        sig_retry()
+                    sig_check()
+                    sig_off()
+                iterations += 1
+            except KeyboardInterrupt:
+                interrupts += 1
+            if cysigs.sig_on_count != 0 or cysigs.block_sigint != 0:
+                failures += 1
+    finally:
+        sent = stop_injector()
+        t = perf_counter() - t
+        # Collect an interrupt which may still be pending
+        try:
+            sig_on()
+            sig_off()
+        except KeyboardInterrupt:
+            interrupts += 1
+
+    return dict(sent=sent, interrupts=interrupts, iterations=iterations,
+            failures=failures, seconds=t, rate=sent / t)
+
+
+def test_interrupt_exceptions(long n):
+    """
+    Raise ``n`` times ``SIGALRM`` inside ``sig_on()`` and return the
+    list of exceptions. These are distinct objects since they are
+    still referenced; see
+    :func:`cysignals.signals.set_exception_cache`.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> L = test_interrupt_exceptions(3)
+        >>> len(set(map(id, L)))
+        3
+        >>> [e.__traceback__ is not None for e in L]
+        [True, True, True]
+
+    """
+    L = []
+    for i in range(n):
+        try:
+            with nogil:
+                sig_on()
+                raise_(SIGALRM)
+                sig_off()
+        except KeyboardInterrupt as e:
+            L.append(e)
+    return L
+
+
+def bench_interrupts(long n=100000, int signum=SIGALRM):
+    """
+    Raise ``n`` interrupts inside ``sig_on()`` and return the average
+    time in nanoseconds from raising the signal until catching the
+    exception in Python. Compare this with
+    :func:`cysignals.signals.set_exception_cache` enabled and disabled.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> bench_interrupts(1000) > 0
+        True
+        >>> print_sig_occurred()
+        No current exception
+
+    """
+    from time import perf_counter
+    cdef long i
+    t = perf_counter()
+    for i in range(n):
+        try:
+            with nogil:
+                sig_on()
+                raise_(signum)
+                sig_off()
+        except KeyboardInterrupt:
+            pass
+    return (perf_counter() - t) * 1e9 / n
+
+
+def test_watchdog(long delay=DEFAULT_DELAY):
+    """
+    The watchdog interrupts ``sig_block()`` after the grace period,
+    long before the blocked section ends::
+
+        >>> from cysignals.tests import *
+        >>> test_watchdog()
+        KeyboardInterrupt()
+        True
+
+    """
+    from time import perf_counter
+    from .signals import start_watchdog, stop_watchdog
+    start_watchdog(0.1, 0.3)
+    t = perf_counter()
+    try:
+        with nogil:
+            sig_str("blocked for a long time")
+            sig_block()
+            signal_after_delay(SIGINT, delay)
+            # The first sleep is cut short by the SIGINT
+            ms_sleep(10 * delay)
+            ms_sleep(10 * delay)
+            sig_unblock()
+            sig_off()
+    except KeyboardInterrupt as e:
+        print(repr(e))
+    finally:
+        stop_watchdog()
+    return perf_counter() - t < 5 * delay / 1000
+
+
 # Special thanks to Robert Bradshaw for suggesting the try/finally
 # construction. -- Jeroen Demeyer
 def test_try_finally_signal(long delay=DEFAULT_DELAY):
@@ -1086,6 +1293,1306 @@ def test_signal_during_malloc(long delay=DEFAULT_DELAY):
         pass
 
 
+########################################################################
+# Test sig_on_local()                                                  #
+########################################################################
+def cysigs_state():
+    """
+    Return ``sig_on_count`` and the number of ``sig_on_local()``
+    scopes.
+    """
+    return (cysigs.sig_on_count, cysigs.local_depth)
+
+cdef int local_stage(int fail, long delay) except -1 nogil:
+    sig_on_local()
+    if fail == 1:
+        abort()
+    if fail == 2:
+        signal_after_delay(SIGINT, delay)
+        ms_sleep(delay * 2)
+    sig_off_local()
+    return 0
+
+def test_sig_on_local(int fail=1, long delay=DEFAULT_DELAY):
+    """
+    A fault inside ``sig_on_local()`` only unwinds the local scope, the
+    enclosing ``sig_on()`` continues::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_on_local()
+        ['ok', "RuntimeError('Aborted')", 'ok', 1, 0]
+
+    Interrupts go to the outermost ``sig_on()``::
+
+        >>> try:
+        ...     test_sig_on_local(2)
+        ... except KeyboardInterrupt:
+        ...     print("KeyboardInterrupt")
+        KeyboardInterrupt
+        >>> cysigs_state()
+        (0, 0)
+
+    """
+    results = []
+    sig_on()
+    for i in range(3):
+        try:
+            local_stage(fail if i == 1 else 0, delay)
+            results.append("ok")
+        except RuntimeError as e:
+            results.append(repr(e))
+    results.append(cysigs.sig_on_count)
+    results.append(cysigs.local_depth)
+    sig_off()
+    return results
+
+def test_sig_on_local_with_interrupts(long delay=DEFAULT_DELAY):
+    """
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_on_local_with_interrupts()
+        (1, 1, 0)
+
+    """
+    cdef int interrupted = 0, count
+    sig_on()
+    sig_on()
+    try:
+        with nogil:
+            sig_on_local_with_interrupts()
+            signal_after_delay(SIGINT, delay)
+            ms_sleep(delay * 2)
+            sig_off_local()
+    except KeyboardInterrupt:
+        interrupted = 1
+    count = cysigs.sig_on_count
+    sig_off()
+    sig_off()
+    return (interrupted, count - 1, cysigs.local_depth)
+
+def test_sig_on_local_blocked_interrupt(long delay=DEFAULT_DELAY):
+    """
+    An interrupt received inside ``sig_block()`` in a scope handling
+    interrupts is raised by ``sig_unblock()``, only once::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_on_local_blocked_interrupt()
+        (1, 0)
+
+    """
+    cdef int interrupted = 0
+    sig_on()
+    try:
+        with nogil:
+            sig_on_local_with_interrupts()
+            sig_block()
+            signal_after_delay(SIGINT, delay)
+            ms_sleep(delay * 2)
+            sig_unblock()
+            sig_off_local()
+    except KeyboardInterrupt:
+        interrupted = 1
+    sig_off()
+    return (interrupted, cysigs.interrupt_received)
+
+def test_sig_on_local_outermost():
+    """
+    Without enclosing ``sig_on()``, ``sig_on_local()`` is like
+    ``sig_on()``::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_on_local_outermost()
+        Traceback (most recent call last):
+        ...
+        RuntimeError: Aborted
+        >>> cysigs_state()
+        (0, 0)
+
+    """
+    local_stage(1, 0)
+
+cdef int local_nest(int n, int fail, long delay) except -1 nogil:
+    if n == 0:
+        return local_stage(fail, delay)
+    sig_on_local()
+    try:
+        local_nest(n - 1, fail, delay)
+    finally:
+        sig_off_local()
+    return 0
+
+def test_sig_on_local_nested(int n, int fail=1, long delay=DEFAULT_DELAY):
+    """
+    Nest ``n`` scopes of ``sig_on_local()`` around ``local_stage()``.
+    Scopes deeper than ``SIG_LOCAL_MAX`` behave like a nested
+    ``sig_on()``, so a fault there goes to the innermost usable scope::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_on_local_nested(20)
+        Traceback (most recent call last):
+        ...
+        RuntimeError: Aborted
+        >>> cysigs_state()
+        (0, 0)
+        >>> test_sig_on_local_nested(20, 0)
+        >>> cysigs_state()
+        (0, 0)
+
+    An interrupt skips the scopes without ``SIG_LOCAL_INTERRUPTS`` up to
+    the outermost ``sig_on_local()``::
+
+        >>> try:
+        ...     test_sig_on_local_nested(3, 2)
+        ... except KeyboardInterrupt:
+        ...     print("KeyboardInterrupt")
+        KeyboardInterrupt
+        >>> cysigs_state()
+        (0, 0)
+
+    """
+    local_nest(n, fail, delay)
+
+
+########################################################################
+# Test sig_dispatch()                                                  #
+########################################################################
+cdef void kernel_illegal(void* arg) noexcept nogil:
+    # Like an instruction which this CPU does not support
+    raise_(SIGILL)
+
+cdef void kernel_abort(void* arg) noexcept nogil:
+    abort()
+
+cdef void kernel_count(void* arg) noexcept nogil:
+    (<int*>arg)[0] += 1
+
+cdef sig_kernel_t dispatch_variants[3]
+
+def test_sig_dispatch(int nillegal=2, bint abort_first=False):
+    """
+    Run a kernel with 3 variants, the first ``nillegal`` of which die
+    from ``SIGILL``, 3 times. Return the exceptions, the number of
+    successful runs and the selected variant.
+
+    Variants dying from ``SIGILL`` are skipped, once and for all::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_dispatch()
+        ([], 3, 2)
+
+    Other signals are not cached as failures::
+
+        >>> test_sig_dispatch(0, abort_first=True)
+        ([RuntimeError('Aborted')], 2, 0)
+
+    If no variant works::
+
+        >>> test_sig_dispatch(3)
+        ([SignalError('Illegal instruction'), RuntimeError('no variant of kernel test can be run on this CPU'), RuntimeError('no variant of kernel test can be run on this CPU')], 0, 3)
+        >>> cysigs_state()
+        (0, 0)
+
+    """
+    cdef sig_dispatch_t d
+    cdef int i, n = 0
+    for i in range(3):
+        dispatch_variants[i] = kernel_illegal if i < nillegal else kernel_count
+    if abort_first:
+        dispatch_variants[0] = kernel_abort
+    sig_dispatch_init(&d, "test", dispatch_variants, 3)
+
+    errors = []
+    for i in range(3):
+        try:
+            with nogil:
+                sig_dispatch(&d, &n)
+        except BaseException as e:
+            errors.append(e)
+            dispatch_variants[0] = kernel_count if abort_first else dispatch_variants[0]
+    return (errors, n, sig_dispatch_selected(&d))
+
+
+########################################################################
+# Test sig_batch()                                                     #
+########################################################################
+cdef void batch_item(size_t i, void* arg) noexcept nogil:
+    # Item i fails with SIGSEGV if i % 10 == 3 and with SIGABRT if
+    # i % 10 == 7; otherwise it stores i^2
+    if i % 10 == 3:
+        dereference_null_pointer()
+    if i % 10 == 7:
+        abort()
+    (<long*>arg)[i] = i * i
+
+def test_sig_batch(size_t n=30, bint nested=False):
+    """
+    Faulting items are isolated, the others are evaluated::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_batch()
+        (6, [3, 7, 13, 17, 23, 27], 3, True, 'SignalError', True)
+        >>> test_sig_batch(nested=True)
+        (6, [3, 7, 13, 17, 23, 27], 3, True, 'SignalError', True)
+        >>> test_sig_batch(3)
+        (0, [], None, False, 'NoneType', True)
+        >>> cysigs_state()
+        (0, 0)
+
+    """
+    cdef long* out = <long*>check_calloc(n + 1, sizeof(long))
+    cdef unsigned char* errors = <unsigned char*>check_malloc(SIG_BATCH_BITMAP_SIZE(n) + 1)
+    cdef sig_batch_status_t status
+    cdef size_t i
+    try:
+        with nogil:
+            if nested:
+                sig_on()
+            sig_batch(batch_item, n, out, errors, &status)
+            if nested:
+                sig_off()
+        failed = [i for i in range(n) if sig_batch_failed(errors, i)]
+        ok = all(out[i] == (0 if i in failed else i * i) for i in range(n))
+        exc = <object>status.first_exc if status.first_exc else None
+        Py_XDECREF(status.first_exc)
+        first = status.first_failed if status.nfailed else None
+        return (status.nfailed, failed, first,
+                status.first_signal in (SIGSEGV, SIGBUS),
+                type(exc).__name__, ok)
+    finally:
+        sig_free(out)
+        sig_free(errors)
+
+cdef void batch_sleep(void* arg) noexcept nogil:
+    ms_sleep((<long*>arg)[0])
+
+def test_sig_batch_interrupt(long delay=DEFAULT_DELAY):
+    """
+    Interrupts stop the whole batch::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_batch_interrupt()
+        KeyboardInterrupt
+        >>> cysigs_state()
+        (0, 0)
+
+    """
+    cdef sig_kernel_t funcs[100]
+    cdef void* args[100]
+    cdef unsigned char errors[13]
+    cdef sig_batch_status_t status
+    cdef long ms = delay
+    cdef int i
+    for i in range(100):
+        funcs[i] = batch_sleep
+        args[i] = &ms
+    try:
+        with nogil:
+            signal_after_delay(SIGINT, delay * 5)
+            sig_batch_calls(funcs, args, 100, errors, &status)
+    except KeyboardInterrupt:
+        print("KeyboardInterrupt")
+
+
+########################################################################
+# Test the yield timer                                                 #
+########################################################################
+def test_yield(long n=100):
+    """
+    Run ``n`` times ``ms_sleep(1)`` and ``sig_check()`` inside
+    ``sig_on()`` without the GIL. See
+    :func:`cysignals.signals.register_yield_callback`.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_yield()
+
+    """
+    cdef long i
+    with nogil:
+        sig_on()
+        for i in range(n):
+            ms_sleep(1)
+            sig_check()
+        sig_off()
+
+
+########################################################################
+# Test control events                                                  #
+########################################################################
+def test_control_event(int value):
+    """
+    Send a control event with payload ``value`` to ourselves inside
+    ``sig_on()`` without the GIL and run ``sig_check()`` until it has
+    been handled. See :func:`cysignals.signals.subscribe_control`.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> from cysignals.signals import subscribe_control, unsubscribe_control
+        >>> values = []
+        >>> callback = lambda event: values.append(event.value)
+        >>> subscribe_control(callback)
+        >>> test_control_event(1)
+        >>> values
+        [1]
+        >>> unsubscribe_control(callback)
+
+    """
+    import signal
+    cdef int signum = signal.SIGRTMIN
+    cdef long i
+    with nogil:
+        sig_on()
+        queue_signal(signum, value)
+        for i in range(100):
+            ms_sleep(1)
+            sig_check()
+        sig_off()
+
+
+########################################################################
+# Test the interruptible blocking primitives from sync.pxd             #
+########################################################################
+
+cdef void* queue_producer(void* q) noexcept nogil:
+    # Push 1, ..., n followed by 0
+    cdef size_t i
+    cdef size_t n = <size_t>(<sig_queue_t*>q).capacity * 100
+    for i in range(1, n + 1):
+        sig_queue_push_no_except(<sig_queue_t*>q, <void*>i)
+    sig_queue_push_no_except(<sig_queue_t*>q, NULL)
+    return NULL
+
+
+def test_sync_queue(int nthreads=4):
+    """
+    Pass integers from ``nthreads`` producer threads through a bounded
+    queue to the main thread. Return the number and the sum of the
+    items received.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sync_queue()
+        (3200, 1281600)
+        >>> test_sync_queue(1)
+        (800, 320400)
+
+    """
+    cdef sig_queue_t q
+    if sig_queue_init(&q, 8):
+        raise MemoryError
+    cdef pthread_t threads[16]
+    cdef int i, done = 0
+    cdef size_t count = 0, total = 0
+    cdef void* item
+    nthreads = min(nthreads, 16)
+    try:
+        with nogil:
+            for i in range(nthreads):
+                pthread_create(&threads[i], NULL, queue_producer, &q)
+            while done < nthreads:
+                sig_queue_pop(&q, &item)
+                if item is NULL:
+                    done += 1
+                else:
+                    count += 1
+                    total += <size_t>item
+            for i in range(nthreads):
+                pthread_join(threads[i], NULL)
+    finally:
+        sig_queue_destroy(&q)
+    return count, total
+
+
+@return_exception
+def test_sync_interrupt_sig_on(long delay=DEFAULT_DELAY):
+    """
+    An interrupt inside ``sig_on()`` while waiting for a semaphore.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sync_interrupt_sig_on()
+        KeyboardInterrupt()
+
+    """
+    cdef sig_sem_t sem
+    sig_sem_init(&sem, 0)
+    with nogil:
+        sig_on()
+        signal_after_delay(SIGINT, delay)
+        sig_sem_wait(&sem)
+        sig_off()
+
+
+cdef struct waiter_t:
+    sig_mutex_t mutex
+    int result
+
+
+cdef void* interruptible_waiter(void* arg) noexcept nogil:
+    # Wait for the mutex without receiving signals ourselves
+    cdef waiter_t* w = <waiter_t*>arg
+    cdef sigset_t mask
+    sigemptyset(&mask)
+    sigaddset(&mask, SIGINT)
+    pthread_sigmask(SIG_BLOCK, &mask, NULL)
+    w.result = sig_mutex_lock_no_except(&w.mutex)
+    return NULL
+
+
+def test_sync_interrupt_thread(long delay=DEFAULT_DELAY):
+    """
+    A thread waiting for a locked mutex is woken up by an interrupt
+    delivered to the main thread. That thread deals with the interrupt,
+    so the main thread does not see it.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sync_interrupt_thread()
+        'interrupted'
+
+    """
+    cdef waiter_t w
+    cdef pthread_t thread
+    w.result = -1
+    sig_mutex_init(&w.mutex)
+    sig_mutex_lock(&w.mutex)
+    with nogil:
+        pthread_create(&thread, NULL, interruptible_waiter, &w)
+        signal_after_delay(SIGINT, delay)
+        ms_sleep(delay * 2)
+        pthread_join(thread, NULL)
+    sig_mutex_unlock(&w.mutex)
+    if w.result == 0:
+        return "interrupted"
+    return w.result
+
+
+cdef struct sem_waiter_t:
+    sig_sem_t sem
+    int result
+
+
+cdef void* sem_waiter(void* arg) noexcept nogil:
+    cdef sem_waiter_t* w = <sem_waiter_t*>arg
+    cdef sigset_t mask
+    sigemptyset(&mask)
+    sigaddset(&mask, SIGINT)
+    pthread_sigmask(SIG_BLOCK, &mask, NULL)
+    w.result = sig_sem_wait_no_except(&w.sem)
+    return NULL
+
+
+def test_sync_interrupt_other_thread(long delay=DEFAULT_DELAY):
+    """
+    A thread waiting for a semaphore while the main thread is inside
+    ``sig_on()`` is woken up by an interrupt, without jumping to the
+    ``sig_on()`` of the main thread. The interrupt stays pending for
+    the main thread, which handles it in ``sig_unblock()``::
+
+        >>> from cysignals.tests import *
+        >>> test_sync_interrupt_other_thread()
+        (0, 'KeyboardInterrupt')
+
+    """
+    cdef sem_waiter_t w
+    cdef pthread_t thread
+    w.result = -1
+    sig_sem_init(&w.sem, 0)
+    exc = None
+    try:
+        with nogil:
+            sig_on()
+            sig_block()
+            pthread_create(&thread, NULL, sem_waiter, &w)
+            ms_sleep(delay)
+            raise_(SIGINT)
+            ms_sleep(delay)
+            sig_sem_post(&w.sem)
+            pthread_join(thread, NULL)
+            sig_unblock()
+            sig_off()
+    except KeyboardInterrupt as e:
+        exc = type(e).__name__
+    return w.result, exc
+
+
+def test_sync_queue_interrupt(long delay=DEFAULT_DELAY):
+    """
+    An interrupt while pushing and popping inside ``sig_on()`` never
+    leaves the queue locked::
+
+        >>> from cysignals.tests import *
+        >>> test_sync_queue_interrupt()
+        ('KeyboardInterrupt', True, 1)
+
+    """
+    cdef sig_queue_t q
+    if sig_queue_init(&q, 4):
+        raise MemoryError
+    cdef void* item
+    cdef bint unlocked
+    try:
+        try:
+            with nogil:
+                sig_on()
+                signal_after_delay(SIGINT, delay)
+                while True:
+                    sig_queue_push(&q, <void*>1)
+                    sig_queue_pop(&q, &item)
+        except KeyboardInterrupt as e:
+            exc = type(e).__name__
+        unlocked = sig_mutex_trylock(&q.lock)
+        if unlocked:
+            sig_mutex_unlock(&q.lock)
+        return exc, unlocked, sig_queue_trypush(&q, <void*>1)
+    finally:
+        sig_queue_destroy(&q)
+
+
+########################################################################
+# Test the interruptible socket I/O from sigio.pxd                     #
+########################################################################
+def test_sigio_transfer(data):
+    """
+    Write ``data`` to a file with ``sig_pwritev``, read it back with
+    ``sig_preadv`` and send it through a socket with ``sig_sendfile``
+    and ``sig_recvmsg``.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sigio_transfer(b"cysignals" * 10000)
+        (90000, 90000, 90000, True)
+
+    """
+    import socket, tempfile, threading
+    cdef bytes src = data
+    cdef size_t n = len(src)
+    cdef bytearray dst = bytearray(n)
+    cdef bytearray received = bytearray(n)
+    cdef char* p = dst
+    cdef iovec iov[3]
+    cdef off_t offset = 0
+    cdef size_t written, read, sent
+    cdef int fd
+
+    f = tempfile.TemporaryFile()
+    a, b = socket.socketpair()
+    try:
+        fd = f.fileno()
+        iov[0].iov_base = <char*>src
+        iov[0].iov_len = n // 2
+        iov[1].iov_base = <char*>src + n // 2
+        iov[1].iov_len = n - n // 2
+        sig_pwritev(fd, iov, 2, 0, &written)
+
+        iov[0].iov_base = p
+        iov[0].iov_len = 1
+        iov[1].iov_base = p + 1
+        iov[1].iov_len = 0
+        iov[2].iov_base = p + 1
+        iov[2].iov_len = n - 1
+        sig_preadv(fd, iov, 3, 0, &read)
+
+        # Receive in a thread, the data does not fit in the socket buffer
+        t = threading.Thread(target=_sigio_receive, args=(b, received))
+        t.start()
+        sig_sendfile(a.fileno(), fd, &offset, n, &sent)
+        t.join()
+    finally:
+        f.close()
+        a.close()
+        b.close()
+    return written, read, sent, dst == src and received == src
+
+
+def _sigio_receive(sock, bytearray buf):
+    cdef iovec iov
+    cdef msghdr msg
+    cdef size_t done
+    cdef int fd = sock.fileno()
+    iov.iov_base = <char*>buf
+    iov.iov_len = len(buf)
+    memset(&msg, 0, sizeof(msg))
+    msg.msg_iov = &iov
+    msg.msg_iovlen = 1
+    with nogil:
+        sig_recvmsg(fd, &msg, 0, &done)
+    assert done == <size_t>len(buf)
+
+
+def test_sigio_interrupt(bint nonblocking, long delay=DEFAULT_DELAY):
+    """
+    Interrupt ``sig_recvmsg`` waiting for more data. The data which was
+    already received is counted in ``done``.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sigio_interrupt(False)
+        (KeyboardInterrupt(), 5, b'hello')
+        >>> test_sigio_interrupt(True)
+        (KeyboardInterrupt(), 5, b'hello')
+
+    """
+    import socket
+    cdef char buf[16]
+    cdef iovec iov
+    cdef msghdr msg
+    cdef size_t done = 0
+    cdef int fd
+
+    a, b = socket.socketpair()
+    try:
+        b.setblocking(not nonblocking)
+        a.send(b"hello")
+        fd = b.fileno()
+        iov.iov_base = buf
+        iov.iov_len = sizeof(buf)
+        memset(&msg, 0, sizeof(msg))
+        msg.msg_iov = &iov
+        msg.msg_iovlen = 1
+        try:
+            with nogil:
+                signal_after_delay(SIGINT, delay)
+                sig_recvmsg(fd, &msg, 0, &done)
+        except KeyboardInterrupt as e:
+            return e, done, buf[:done]
+    finally:
+        a.close()
+        b.close()
+
+
+########################################################################
+# Test cancellation flags                                              #
+########################################################################
+def test_cancel_sig_on(job):
+    """
+    Cancel job 1 before ``sig_on()`` while watching job ``job``.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_cancel_sig_on(0)
+        'not cancelled'
+        >>> test_cancel_sig_on(1)
+        'cancelled'
+
+    """
+    from .signals import CancelFlags, CancelInterrupt
+    flags = CancelFlags(2)
+    flags.watch(job)
+    flags.cancel(1)
+    try:
+        sig_on()
+        sig_off()
+    except CancelInterrupt:
+        return "cancelled"
+    finally:
+        flags.unwatch()
+    return "not cancelled"
+
+
+def test_cancel_sig_check(bint inside_sig_on, long delay=DEFAULT_DELAY):
+    """
+    Cancel all jobs from another thread while looping over
+    ``sig_check()``. After the cancellation, the flags are no longer
+    watched.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_cancel_sig_check(True)
+        (CancelInterrupt(), True)
+        >>> test_cancel_sig_check(False)
+        (CancelInterrupt(), True)
+
+    """
+    import threading
+    from .signals import CancelFlags, CancelInterrupt
+    flags = CancelFlags(1)
+    flags.watch(0)
+    threading.Timer(delay / 1000.0, flags.cancel).start()
+    try:
+        with nogil:
+            if inside_sig_on:
+                sig_on()
+            while True:
+                sig_check()
+    except CancelInterrupt as e:
+        return e, cysigs.cancel_flags is NULL
+    finally:
+        flags.unwatch()
+
+
+def test_cancel_fork(long delay=DEFAULT_DELAY):
+    """
+    Cancel a job running in a forked worker process.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_cancel_fork()
+        42
+
+    """
+    import os
+    from .signals import CancelFlags, CancelInterrupt
+    flags = CancelFlags(8)
+    pid = os.fork()
+    if pid == 0:
+        try:
+            flags.watch(5)
+            with nogil:
+                sig_on()
+                while True:
+                    sig_check()
+        except CancelInterrupt:
+            os._exit(42)
+        finally:
+            os._exit(1)
+    with nogil:
+        ms_sleep(delay)
+    flags.cancel(5)
+    return os.waitpid(pid, 0)[1] >> 8
+
+
+########################################################################
+# Test shrinkers                                                       #
+########################################################################
+cdef size_t count_shrinks(size_t needed, void* arg) noexcept nogil:
+    (<long*>arg)[0] += 1
+    return 1
+
+def test_shrinkers():
+    """
+    Try an allocation which certainly fails, such that all shrinkers
+    are called. See also ``register_shrinker()`` in ``signals.pyx``.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_shrinkers()
+        Traceback (most recent call last):
+        ...
+        MemoryError: failed to allocate 1152921504606846976 bytes
+
+    """
+    check_malloc((<size_t>1) << 60)
+
+def test_c_shrinkers():
+    """
+    C shrinkers returning non-zero cause the allocation to be retried.
+    Each shrinker is called once for each failing allocation::
+
+        >>> from cysignals.tests import *
+        >>> test_c_shrinkers()
+        (True, 2, 2)
+
+    """
+    cdef long a = 0, b = 0
+    cdef bint failed
+    sig_register_shrinker(count_shrinks, &a, 10)
+    sig_register_shrinker(count_shrinks, &b, -10)
+    try:
+        with nogil:
+            failed = sig_malloc((<size_t>1) << 60) == NULL
+            sig_realloc(NULL, (<size_t>1) << 60)
+    finally:
+        sig_unregister_shrinker(count_shrinks, &a)
+        sig_unregister_shrinker(count_shrinks, &b)
+    return failed, a, b
+
+
+########################################################################
+# Test sig_on_quota()                                                  #
+########################################################################
+def test_quota_peak():
+    """
+    Account the allocations inside ``sig_on_quota()``. Nothing is
+    accounted after ``sig_off()``.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_quota_peak()
+        (0, True, 0)
+
+    """
+    from .signals import quota_usage
+    cdef void* p
+    cdef void* q
+    with nogil:
+        sig_on_quota(0)
+        p = sig_malloc(1000)
+        q = sig_calloc(50, 100)
+        q = sig_realloc(q, 10000)
+        sig_free(p)
+        sig_free(q)
+        sig_off()
+        p = sig_malloc(1000)
+        sig_free(p)
+    current, peak = quota_usage()
+    return current, 11000 <= peak < 11100, cysigs.quota_depth
+
+
+# Blocks allocated by test_quota_exceeded(), global such that they
+# survive the jump back to sig_on_quota()
+cdef void* quota_blocks[100]
+cdef int quota_nblocks
+
+
+def test_quota_exceeded():
+    """
+    Exceed the quota of 100000 bytes allocating blocks of 10000 bytes.
+    The last allocation fails before allocating anything.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_quota_exceeded()
+        (MemoryError('memory quota of sig_on_quota() exceeded'), 9, True)
+
+    """
+    from .signals import quota_usage
+    global quota_nblocks
+    quota_nblocks = 0
+    try:
+        with nogil:
+            sig_on_quota(100000)
+            while quota_nblocks < 100:
+                quota_blocks[quota_nblocks] = sig_malloc(10000)
+                quota_nblocks += 1
+            sig_off()
+    except MemoryError as e:
+        current, peak = quota_usage()
+        return e, quota_nblocks, current == peak
+    finally:
+        for i in range(quota_nblocks):
+            sig_free(quota_blocks[i])
+
+
+def test_quota_calloc_overflow():
+    """
+    A ``sig_calloc()`` whose size overflows exceeds the quota::
+
+        >>> from cysignals.tests import *
+        >>> test_quota_calloc_overflow()
+        MemoryError('memory quota of sig_on_quota() exceeded')
+
+    """
+    cdef size_t n = (<size_t>(-1)) // 2 + 1
+    try:
+        with nogil:
+            sig_on_quota(100000)
+            sig_calloc(n, 2)
+            sig_off()
+    except MemoryError as e:
+        return e
+
+
+cdef void* quota_thread(void* arg) noexcept nogil:
+    sig_on_quota_no_except(0)
+    sig_free(sig_malloc(60000))
+    sig_off()
+    return NULL
+
+
+def test_quota_thread():
+    """
+    A region started by another thread inside the region of the main
+    thread does not affect the latter: the second allocation of 60000
+    bytes in the main thread exceeds its quota of 100000 bytes::
+
+        >>> from cysignals.tests import *
+        >>> test_quota_thread()
+        (MemoryError('memory quota of sig_on_quota() exceeded'), 1, 0)
+
+    """
+    cdef pthread_t thread
+    global quota_nblocks
+    quota_nblocks = 0
+    try:
+        with nogil:
+            sig_on_quota(100000)
+            quota_blocks[quota_nblocks] = sig_malloc(60000)
+            quota_nblocks += 1
+            pthread_create(&thread, NULL, quota_thread, NULL)
+            pthread_join(thread, NULL)
+            quota_blocks[quota_nblocks] = sig_malloc(60000)
+            quota_nblocks += 1
+            sig_off()
+    except MemoryError as e:
+        return e, quota_nblocks, cysigs.quota_depth
+    finally:
+        for i in range(quota_nblocks):
+            sig_free(quota_blocks[i])
+
+
+########################################################################
+# Test aligned, huge page and NUMA allocations                         #
+########################################################################
+def test_aligned_alloc(size_t alignment=64, size_t n=1000):
+    """
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_aligned_alloc()
+        0
+        >>> test_aligned_alloc(4096, 1)
+        0
+        >>> test_aligned_alloc(48)
+        Traceback (most recent call last):
+        ...
+        ValueError: alignment must be a power of 2, got 48
+        >>> test_aligned_alloc(64, 1 << 62)
+        Traceback (most recent call last):
+        ...
+        MemoryError: failed to allocate 4611686018427387904 * 8 bytes
+
+    """
+    cdef double* a = <double*>check_aligned_alloc(alignment, n, sizeof(double))
+    cdef size_t i
+    for i in range(n):
+        a[i] = i
+    r = (<size_t>a) % alignment
+    sig_free(a)
+    return r
+
+def test_hugepage_alloc(size_t n=1 << 22):
+    """
+    Large allocations are aligned to huge pages (2 MiB)::
+
+        >>> from cysignals.tests import *
+        >>> test_hugepage_alloc()
+        (0, 3, 0)
+        >>> test_hugepage_alloc(1)
+        (0, 3, 3)
+
+    """
+    cdef char* a = <char*>check_hugepage_alloc(n, 1)
+    with nogil:
+        sig_on()
+        a[n - 1] = 3
+        sig_off()
+    r = ((<size_t>a) % min(n, <size_t>1 << 21), a[n - 1], a[0])
+    sig_mapped_free(a, n)
+    return r
+
+def test_numa_alloc(int node=0, size_t n=100000):
+    """
+    If there is no such node, the memory is still allocated::
+
+        >>> from cysignals.tests import *
+        >>> test_numa_alloc()
+        4950
+        >>> test_numa_alloc(999)
+        4950
+        >>> test_numa_alloc(-1)
+        Traceback (most recent call last):
+        ...
+        ValueError: NUMA node must be >= 0, got -1
+
+    """
+    cdef long* a = <long*>check_numa_alloc(n, sizeof(long), node)
+    cdef size_t i
+    cdef long s = 0
+    with nogil:
+        sig_on()
+        for i in range(100):
+            a[i * 1000] = i
+        for i in range(n):
+            s += a[i]
+        sig_off()
+    sig_mapped_free(a, n * sizeof(long))
+    return s
+
+
+########################################################################
+# Test interrupt protocols of other libraries                          #
+########################################################################
+# A fake library with its own critical section flag
+cdef int fake_block = 0
+cdef int fake_pending = 0
+cdef int fake_recovered = 0
+
+cdef void fake_recover(void* arg) noexcept nogil:
+    global fake_recovered
+    fake_recovered += 1
+
+def test_protocol(long delay=DEFAULT_DELAY):
+    """
+    An interrupt inside the critical section of the fake library is
+    deferred until the library re-raises it::
+
+        >>> from cysignals.tests import *
+        >>> test_protocol()
+        (2, 0, 1)
+
+    """
+    global fake_block, fake_pending, fake_recovered
+    cdef int pending
+    fake_recovered = 0
+    assert sig_register_protocol(&fake_block, &fake_pending, fake_recover, NULL) == 0
+    try:
+        with nogil:
+            sig_on()
+            fake_block = 1
+            signal_after_delay(SIGINT, delay)
+            ms_sleep(delay * 2)
+            pending = fake_pending
+            # Leave the critical section like PARI_SIGINT_unblock
+            fake_block = 0
+            if fake_pending:
+                raise_(fake_pending)
+            sig_off()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        assert sig_unregister_protocol(&fake_block) == 0
+    return (pending, fake_pending, fake_recovered)
+
+def test_mp_memory_functions():
+    """
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_mp_memory_functions()
+        Traceback (most recent call last):
+        ...
+        MemoryError
+
+    """
+    cdef char* p = <char*>sig_mp_alloc(100)
+    p = <char*>sig_mp_realloc(p, 100, 200000)
+    p[199999] = 1
+    sig_mp_free(p, 200000)
+    with nogil:
+        sig_on()
+        sig_mp_alloc((<size_t>1) << 62)
+        sig_off()
+
+
+########################################################################
+# Test guarded arrays                                                  #
+########################################################################
+def test_guarded_allocarray(long n=1000):
+    """
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_guarded_allocarray()
+        499500
+        >>> test_guarded_allocarray(0)
+        0
+
+    """
+    cdef long* a = <long*>check_guarded_allocarray(n, sizeof(long), "a")
+    cdef long i, s = 0
+    try:
+        with nogil:
+            sig_on()
+            for i in range(n):
+                a[i] = i
+            for i in range(n):
+                s += a[i]
+            sig_off()
+    finally:
+        sig_guarded_free(a)
+    return s
+
+def test_guarded_overflow(long index=10):
+    """
+    TESTS:
+
+    Writing just past the end of a guarded array::
+
+        >>> from cysignals.tests import *
+        >>> test_guarded_overflow()
+        Traceback (most recent call last):
+        ...
+        SignalError: out-of-bounds access at byte offset 40 of guarded array 'buf' of size 40
+
+    Writing before the start, into the leading guard page::
+
+        >>> test_guarded_overflow(-1030)
+        Traceback (most recent call last):
+        ...
+        SignalError: out-of-bounds access at byte offset -4120 of guarded array 'buf' of size 40
+
+    Other segmentation faults are not affected::
+
+        >>> test_dereference_null_pointer()
+        Traceback (most recent call last):
+        ...
+        SignalError: ...
+        >>> on_stack()
+        False
+
+    """
+    cdef volatile_int* a = <volatile_int*>check_guarded_allocarray(10, sizeof(int), "buf")
+    try:
+        with nogil:
+            sig_on()
+            a[index] = 1
+            sig_off()
+    finally:
+        sig_guarded_free(<void*>a)
+
+
+########################################################################
+# Test lazy arrays                                                     #
+########################################################################
+cdef volatile_int lazy_fill_count = 0
+
+cdef void fill_squares(void* page, size_t offset, size_t length, void* arg) noexcept nogil:
+    # Fill with squares modulo the modulus pointed to by arg
+    global lazy_fill_count
+    lazy_fill_count += 1
+    cdef long* p = <long*>page
+    cdef long m = (<long*>arg)[0]
+    cdef long j = offset // sizeof(long)
+    cdef size_t i
+    for i in range(length // sizeof(long)):
+        p[i] = ((j + i) * (j + i)) % m
+
+def test_lazy_malloc(long n=10**7, long modulus=65537):
+    """
+    Only the pages which are accessed are computed. Here, these are 4
+    pages since ``a[0]`` and ``a[1]`` are on the same page::
+
+        >>> from cysignals.tests import *
+        >>> test_lazy_malloc()
+        ([0, 0, 24235, 1, 58015], 4)
+
+    """
+    global lazy_fill_count
+    lazy_fill_count = 0
+    cdef long* a = <long*>check_lazy_malloc(n * sizeof(long),
+            fill_squares, &modulus, "squares")
+    try:
+        with nogil:
+            sig_on()
+            sig_off()
+        return [a[0], a[modulus], a[n - 1], a[1], a[n // 2]], lazy_fill_count
+    finally:
+        sig_lazy_free(a)
+
+def test_lazy_write():
+    """
+    Lazy arrays are read-only::
+
+        >>> from cysignals.tests import *
+        >>> test_lazy_write()
+        Traceback (most recent call last):
+        ...
+        SignalError: write access at byte offset 8 of read-only lazy array 'squares' of size 80
+
+    """
+    cdef long modulus = 7
+    cdef volatile_int* a = <volatile_int*>check_lazy_malloc(10 * sizeof(long),
+            fill_squares, &modulus, "squares")
+    try:
+        with nogil:
+            sig_on()
+            a[2] = a[2] + 1
+            sig_off()
+    finally:
+        sig_lazy_free(<void*>a)
+
+cdef void* region_stress(void* arg) noexcept nogil:
+    # Allocate and free guarded and lazy arrays of varying sizes,
+    # counting the arrays with wrong contents in arg[0]
+    cdef long* bad = <long*>arg
+    cdef long modulus = 7
+    cdef long* g
+    cdef long* z
+    cdef size_t i, n
+    for i in range(2000):
+        n = 1 + (i * 37) % 3000
+        g = <long*>sig_guarded_malloc(n * sizeof(long), "stress")
+        z = <long*>sig_lazy_malloc(n * sizeof(long),
+                fill_squares, &modulus, "stress")
+        if g is NULL or z is NULL:
+            __sync_fetch_and_add(bad, 1)
+        else:
+            g[n - 1] = <long>n
+            if g[n - 1] != <long>n or z[n - 1] != <long>(((n - 1) * (n - 1)) % 7):
+                __sync_fetch_and_add(bad, 1)
+        sig_guarded_free(g)
+        sig_lazy_free(z)
+    return NULL
+
+def test_region_threads(int nthreads=8):
+    """
+    Allocate and free guarded and lazy arrays concurrently, such that
+    slots of the region table are reused while other threads free
+    theirs::
+
+        >>> from cysignals.tests import *
+        >>> test_region_threads()
+        0
+
+    """
+    cdef pthread_t threads[16]
+    cdef long bad = 0
+    cdef int i
+    nthreads = min(nthreads, 16)
+    with nogil:
+        for i in range(nthreads):
+            pthread_create(&threads[i], NULL, region_stress, &bad)
+        for i in range(nthreads):
+            pthread_join(threads[i], NULL)
+    return bad
+
+
+########################################################################
+# Test mapped files                                                    #
+########################################################################
+def test_mmap_file_truncated(long long offset=100):
+    """
+    Reading a mapped file which was truncated raises
+    ``MappedFileError``, also when accessing the same page again::
+
+        >>> from cysignals.tests import *
+        >>> test_mmap_file_truncated()
+        (120, [(5, 100, True), (5, 100, True)])
+        >>> cysigs_state()
+        (0, 0)
+
+    """
+    import os, tempfile
+    from .signals import MappedFileError
+    cdef size_t ps = sysconf(_SC_PAGESIZE)
+    fd, path = tempfile.mkstemp()
+    cdef volatile char* a = NULL
+    cdef char c
+    try:
+        os.write(fd, b"x" * (3 * ps))
+        a = <volatile char*>check_mmap_file(fd, offset, 3 * ps - offset, False, path)
+        os.ftruncate(fd, ps)
+        errors = []
+        for i in range(2):
+            try:
+                with nogil:
+                    sig_on()
+                    c = a[2 * ps]
+                    sig_off()
+            except MappedFileError as e:
+                # Subtract 2 * ps such that the result does not depend on the page size
+                errors.append((e.errno, e.offset - 2 * ps, e.filename == path))
+        return a[0], errors
+    finally:
+        sig_munmap_file(<void*>a)
+        os.close(fd)
+        os.unlink(path)
+
 ########################################################################
 # Benchmarking functions                                               #
 ########################################################################
@@ -25,6 +25,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -65,6 +67,20 @@ static void ms_sleep(long ms)
 }
 
 
+/* Queue signal ``signum`` with payload ``value`` to the running
+ * process */
+static void queue_signal(int signum, int value)
+{
+#if HAVE_SIGQUEUE
+    union sigval v;
+    v.sival_int = value;
+    sigqueue(getpid(), signum, v);
+#else
+    raise(signum);
+#endif
+}
+
+
 /* Signal the running process with signal ``signum`` after ``ms``
  * milliseconds.  Wait ``interval`` milliseconds, then signal again.
  * Repeat this until ``n`` signals have been sent.
@@ -144,3 +160,119 @@ static void signals_after_delay(int signum, long ms, long interval, int n)
 
 /* Send just one signal */
 #define signal_after_delay(signum, ms) signals_after_delay(signum, ms, 0, 1)
+
+
+/* In-process signal injection for stress testing. A helper thread
+ * sends ``n`` signals ``signum`` to the thread which started it using
+ * pthread_kill() (which is tgkill() on Linux). The first signal is
+ * sent after ``delay`` microseconds, then every ``interval``
+ * microseconds plus a random jitter in [0, jitter] determined by
+ * ``seed``. Deadlines are absolute, so the schedule does not drift.
+ * Short waits are done by spinning to get microsecond precision. */
+typedef struct
+{
+    pthread_t target;
+    int signum;
+    long delay, interval, jitter, n;
+    unsigned long rng;
+    volatile long sent;
+    volatile int running;
+    volatile int stop;
+} injector_t;
+
+static injector_t injector;
+static pthread_t injector_thread;
+
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Wait until the absolute time ``deadline`` (from now_us()) */
+static void wait_until_us(long long deadline)
+{
+    long long t;
+    while ((t = now_us()) < deadline && !injector.stop)
+    {
+        if (deadline - t > 200)
+        {
+            struct timespec ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = (deadline - t - 100) * 1000;
+            if (ts.tv_nsec >= 1000000000) ts.tv_nsec = 999999999;
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+
+static void* injector_main(void* arg)
+{
+    long long deadline = now_us() + injector.delay;
+    while (injector.sent < injector.n && !injector.stop)
+    {
+        wait_until_us(deadline);
+        if (injector.stop) break;
+        if (pthread_kill(injector.target, injector.signum)) break;
+        injector.sent++;
+
+        deadline += injector.interval;
+        if (injector.jitter > 0)
+        {
+            /* xorshift64 */
+            injector.rng ^= injector.rng << 13;
+            injector.rng ^= injector.rng >> 7;
+            injector.rng ^= injector.rng << 17;
+            deadline += injector.rng % (unsigned long)(injector.jitter + 1);
+        }
+    }
+    injector.running = 0;
+    return NULL;
+}
+
+
+/* Start injecting signals into the calling thread. Return 0 on
+ * success, -1 if an injector is already running or the thread could
+ * not be created. */
+static int start_injector(int signum, long delay, long interval,
+                          long jitter, long n, unsigned long seed)
+{
+    if (injector.running) return -1;
+    injector.target = pthread_self();
+    injector.signum = signum;
+    injector.delay = delay;
+    injector.interval = interval;
+    injector.jitter = jitter;
+    injector.n = n;
+    injector.rng = seed * 2654435761UL + 1;
+    injector.sent = 0;
+    injector.stop = 0;
+    injector.running = 1;
+    if (pthread_create(&injector_thread, NULL, injector_main, NULL))
+    {
+        injector.running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Is the injector still sending signals? */
+static int injector_running(void)
+{
+    return injector.running;
+}
+
+
+/* Stop the injector (if it is still running) and wait for it. Return
+ * the number of signals which were sent. */
+static long stop_injector(void)
+{
+    injector.stop = 1;
+    pthread_join(injector_thread, NULL);
+    return injector.sent;
+}
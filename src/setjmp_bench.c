@@ -2,10 +2,14 @@
 #include <stdlib.h>
 #include <setjmp.h>
 #include <sys/time.h>
+#include "cysignals/fast_setjmp.h"
 
 
 static jmp_buf env;
 static sigjmp_buf sigenv;
+#if CYFAST_SETJMP_SUPPORTED
+static cyfast_jmp_buf fastenv;
+#endif
 
 
 #define BENCH(CODE) \
@@ -32,4 +36,21 @@ int main(int argc, char** argv)
 
     BENCH(if (sigsetjmp(env, 1)) return 0)
     printf("Time for sigsetjmp(env, 1):%8.2fns\n", ns);
+
+#if CYFAST_SETJMP_SUPPORTED
+    BENCH(if (cyfast_setjmp(fastenv)) return 0)
+    printf("Time for cyfast_setjmp(env):%7.2fns\n", ns);
+
+    /* Round trips, also checking that the registers survive */
+    volatile long count = 0;
+    long check = 0;
+    BENCH(check += i; if (cyfast_setjmp(fastenv) == 0) cyfast_longjmp(fastenv, 1); count++)
+    printf("Time for cyfast round trip:%8.2fns\n", ns);
+    if (count != N || check != N * (N - 1) / 2)
+    {
+        printf("cyfast_setjmp() round trip FAILED\n");
+        return 1;
+    }
+#endif
+    return 0;
 }